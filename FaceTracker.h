@@ -2,11 +2,17 @@
 #include <functional>
 #include <string>
 #include <thread>
+#ifdef FACE_TRACKER_REPLAY
+// Eye data comes from a recording instead of SRanipal (see replay())
+#include <chrono>
+#include <vector>
+#else
 #include "ViveSR/SRanipal.h"
 #include "ViveSR/SRanipal_Eye.h"
 #include "ViveSR/SRanipal_Lip.h"
 #include "ViveSR/SRanipal_Enums.h"
 #pragma comment (lib, "SRanipal.lib")
+#endif
 
 #ifndef FACE_TRACKER_SLEEP
 #warning FACE_TRACKER_SLEEP not defined. The data query thread will run as fast as possible which is probably not what you want.
@@ -83,6 +89,102 @@ public:
 
 	float period() const { return mPeriod; }
 
+#ifdef FACE_TRACKER_REPLAY
+	/// Eye data at a time, in seconds, from the start of a recording
+	struct ReplaySample{
+		double time = 0.;
+		EyeData data;
+	};
+
+	/// Set recording to play back; samples must be in time order
+	FaceTracker& replay(const std::vector<ReplaySample>& v, bool loop=true){
+		mReplay = v; mReplayLoop = loop; return *this; }
+
+	/// Load recording from text file
+
+	/// Each line holds time, gaze direction and, optionally, openness of
+	/// the left and right eyes, separated by spaces:
+	///	time gazeDirX gazeDirY gazeDirZ [opennessL opennessR]
+	bool loadReplay(const char * path, bool loop=true){
+		auto file = fopen(path, "r");
+		if(!file){
+			printf("Error: Unable to open replay file %s\n", path);
+			return false;
+		}
+		std::vector<ReplaySample> samples;
+		char line[256];
+		while(fgets(line, sizeof(line), file)){
+			ReplaySample s;
+			auto& d = s.data;
+			int n = sscanf(line, "%lf %f %f %f %f %f", &s.time, &d.gazeDir[0], &d.gazeDir[1], &d.gazeDir[2], &d.openness[0], &d.openness[1]);
+			if(n < 4) continue; // comment or blank
+			d.gazeDirValid = true;
+			d.opennessValid = n >= 6;
+			samples.push_back(s);
+		}
+		fclose(file);
+		replay(samples, loop);
+		return !samples.empty();
+	}
+
+	bool init(){
+		if(STATUS_ENABLE == mEyeTracking){
+			if(mReplay.empty()){
+				printf("Error: No eye data to replay\n");
+				return false;
+			}
+			mEyeTracking = STATUS_INIT;
+		}
+		if(STATUS_ENABLE == mLipTracking){
+			printf("Lip tracking not supported in replay\n");
+			mLipTracking = STATUS_DISABLE;
+		}
+		return true;
+	}
+
+	bool start(){
+		if(needsInit()){
+			auto good = init();
+			if(!good) return false;
+		}
+
+		if(initGood() && mThread == nullptr){
+			mRunning = true;
+			mThread = new std::thread([this](){
+				using clock = std::chrono::steady_clock;
+				const auto t0 = clock::now();
+				const double duration = mReplay.back().time;
+				size_t next = 0;
+				double offset = 0.;
+				while(mRunning){
+					const double t = std::chrono::duration<double>(clock::now() - t0).count() - offset;
+					// Deliver the latest sample due, as a tracker polled at this rate would
+					size_t due = next;
+					while(due < mReplay.size() && mReplay[due].time <= t) ++due;
+					if(due != next){
+						mEyeData = mReplay[due-1].data;
+						next = due;
+						if(mOnEyeData) mOnEyeData();
+					}
+					if(next == mReplay.size() && mReplayLoop){
+						next = 0;
+						offset += duration;
+					}
+					FACE_TRACKER_SLEEP(mPeriod);
+				}
+			});
+		}
+		return mRunning;
+	}
+
+	FaceTracker& release(){
+		if(!mRunning){
+			mEyeTracking = STATUS_DISABLE;
+			mLipTracking = STATUS_DISABLE;
+		}
+		return *this;
+	}
+#else
 	bool init(){
 		// Note that this will automatically start up the SR_Runtime if it is
 		// not already running.
@@ -206,6 +308,8 @@ public:
 		return mRunning;
 	}
 
+#endif
+
 	FaceTracker& stop(){
 		if(mThread != nullptr){
 			mRunning = false;
@@ -216,6 +320,7 @@ public:
 		return *this;
 	}
 
+#ifndef FACE_TRACKER_REPLAY
 	FaceTracker& release(){
 		using namespace ViveSR;
 		if(!mRunning){
@@ -226,6 +331,7 @@ public:
 		}
 		return *this;
 	}
+#endif
 
 private:
 	enum{
@@ -238,8 +344,13 @@ private:
 	std::function<void(void)> mOnLipData;
 
 	EyeData mEyeData;
+#ifdef FACE_TRACKER_REPLAY
+	std::vector<ReplaySample> mReplay;
+	bool mReplayLoop = true;
+#else
 	ViveSR::anipal::Lip::LipData mLipData;
     char mLipImage[800 * 400];
+#endif
 	std::thread * mThread = nullptr;
 	float mPeriod = 5./1000;
 	bool mRunning = false;
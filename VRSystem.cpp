@@ -1,6 +1,12 @@
 #include <algorithm> // sort
+#include <atomic>
+#include <chrono>
 #include <cmath> // atan2
+#include <condition_variable>
 #include <cstdint> // uintptr_t
+#include <cstring> // strstr
+#include <mutex>
+#include <thread>
 #include <stdio.h>
 
 #if defined(__APPLE__) && defined(__MACH__)
@@ -23,6 +29,67 @@
 
 typedef VRSystem::Matrix4 Matrix4;
 typedef VRSystem::Vec4 Vec4;
+typedef VRSystem::RigidPose RigidPose;
+
+// Debug counter of heap allocations used to verify the frame loop doesn't allocate
+#ifdef VRSYSTEM_COUNT_ALLOCS
+#include <cstdlib> // malloc, free
+#include <new> // bad_alloc
+
+#if defined(_MSC_VER)
+	#define VRSYSTEM_NOINLINE __declspec(noinline)
+#else
+	#define VRSYSTEM_NOINLINE __attribute__((noinline))
+#endif
+
+namespace{
+std::atomic<unsigned long> gNumAllocs{0};
+
+// Out of line so the compiler does not pair malloc/free in the operators
+// below with inlined new/delete expressions and warn of a mismatch
+VRSYSTEM_NOINLINE void * countedAlloc(std::size_t size){
+	gNumAllocs.fetch_add(1, std::memory_order_relaxed);
+	if(void * p = std::malloc(size ? size : 1)) return p;
+	throw std::bad_alloc();
+}
+VRSYSTEM_NOINLINE void countedFree(void * p){ std::free(p); }
+
+#ifdef __cpp_aligned_new
+// Over-allocate and keep the malloc'd pointer just before the aligned block
+VRSYSTEM_NOINLINE void * countedAlignedAlloc(std::size_t size, std::size_t align){
+	gNumAllocs.fetch_add(1, std::memory_order_relaxed);
+	const auto a = std::max(align, sizeof(void *));
+	if(void * raw = std::malloc(size + a)){
+		auto p = (void **)((std::uintptr_t(raw) + a) & ~std::uintptr_t(a-1));
+		p[-1] = raw;
+		return p;
+	}
+	throw std::bad_alloc();
+}
+VRSYSTEM_NOINLINE void countedAlignedFree(void * p){ if(p) std::free(((void **)p)[-1]); }
+#endif
+}
+
+void * operator new(std::size_t size){ return countedAlloc(size); }
+void * operator new[](std::size_t size){ return countedAlloc(size); }
+void operator delete(void * p) noexcept { countedFree(p); }
+void operator delete[](void * p) noexcept { countedFree(p); }
+void operator delete(void * p, std::size_t) noexcept { countedFree(p); }
+void operator delete[](void * p, std::size_t) noexcept { countedFree(p); }
+
+#ifdef __cpp_aligned_new
+void * operator new(std::size_t size, std::align_val_t a){ return countedAlignedAlloc(size, std::size_t(a)); }
+void * operator new[](std::size_t size, std::align_val_t a){ return countedAlignedAlloc(size, std::size_t(a)); }
+void operator delete(void * p, std::align_val_t) noexcept { countedAlignedFree(p); }
+void operator delete[](void * p, std::align_val_t) noexcept { countedAlignedFree(p); }
+void operator delete(void * p, std::size_t, std::align_val_t) noexcept { countedAlignedFree(p); }
+void operator delete[](void * p, std::size_t, std::align_val_t) noexcept { countedAlignedFree(p); }
+#endif
+
+unsigned long VRSystem::allocations(){ return gNumAllocs.load(std::memory_order_relaxed); }
+#else
+unsigned long VRSystem::allocations(){ return 0; }
+#endif
 
 void Matrix4::print() const {
 	for(int r=0; r<4; ++r){
@@ -33,6 +100,214 @@ void Matrix4::print() const {
 	}
 }
 
+namespace{
+
+// Fixed set of worker threads for splitting large data-parallel jobs
+class WorkerPool{
+public:
+	typedef void (*Task)(void * ctx, size_t begin, size_t end);
+
+	static WorkerPool& get(){
+		static WorkerPool pool;
+		return pool;
+	}
+
+	~WorkerPool(){
+		{ std::lock_guard<std::mutex> lock(mMutex);
+			mQuit = true;
+		}
+		mWake.notify_all();
+		for(auto& t : mThreads) t.join();
+	}
+
+	unsigned numThreads() const { return mThreads.size() + 1; }
+
+	/// Run task over [0,count) in chunks; the calling thread participates
+	void run(Task task, void * ctx, size_t count, size_t chunk){
+		std::lock_guard<std::mutex> jobLock(mJobMutex); // one job at a time
+		{ std::unique_lock<std::mutex> lock(mMutex);
+			// workers that woke late from the last job must leave first
+			mDone.wait(lock, [this]{ return 0 == mActive; });
+			mTask = task; mCtx = ctx; mCount = count; mChunk = chunk;
+			mNumChunks = (count + chunk - 1) / chunk;
+			mChunksLeft = mNumChunks;
+			mNextChunk = 0;
+			++mJobID;
+		}
+		mWake.notify_all();
+		work();
+		std::unique_lock<std::mutex> lock(mMutex);
+		mDone.wait(lock, [this]{ return 0 == mChunksLeft; });
+	}
+
+private:
+	std::vector<std::thread> mThreads;
+	std::mutex mJobMutex, mMutex;
+	std::condition_variable mWake, mDone;
+	Task mTask = nullptr;
+	void * mCtx = nullptr;
+	size_t mCount = 0, mChunk = 1, mNumChunks = 0;
+	std::atomic<size_t> mNextChunk{0};
+	size_t mChunksLeft = 0;
+	unsigned mJobID = 0;
+	unsigned mActive = 0; // workers inside work()
+	bool mQuit = false;
+
+	WorkerPool(){
+		unsigned n = std::thread::hardware_concurrency();
+		if(n > 1) --n; // calling thread is a worker too
+		for(unsigned i=0; i<n; ++i){
+			mThreads.emplace_back([this](){
+				unsigned lastJob = 0;
+				while(true){
+					{ std::unique_lock<std::mutex> lock(mMutex);
+						mWake.wait(lock, [&]{ return mQuit || lastJob != mJobID; });
+						if(mQuit) return;
+						lastJob = mJobID;
+						++mActive;
+					}
+					work();
+					std::lock_guard<std::mutex> lock(mMutex);
+					if(0 == --mActive) mDone.notify_all();
+				}
+			});
+		}
+	}
+
+	void work(){
+		size_t done = 0;
+		for(size_t c; (c = mNextChunk++) < mNumChunks; ++done){
+			const size_t beg = c*mChunk;
+			mTask(mCtx, beg, std::min(beg + mChunk, mCount));
+		}
+		if(done){
+			std::lock_guard<std::mutex> lock(mMutex);
+			mChunksLeft -= done;
+			if(0 == mChunksLeft) mDone.notify_all();
+		}
+	}
+};
+
+// Arrays smaller than this are transformed on the calling thread
+const size_t kParallelThreshold = 1<<15;
+
+struct TransformJob{
+	const float * m;
+	float * dst;
+	const float * src;
+	unsigned dstStride, srcStride;
+};
+
+// dst = m * (src,W) for W = 0 (direction) or 1 (point)
+template <int W>
+void transformRange(void * ctx, size_t beg, size_t end){
+	const auto& job = *(const TransformJob *)ctx;
+	const float * m = job.m;
+	float * dst = job.dst + beg*job.dstStride;
+	const float * src = job.src + beg*job.srcStride;
+	#if defined(VRSYSTEM_SSE)
+		const auto c0 = _mm_loadu_ps(m), c1 = _mm_loadu_ps(m+4), c2 = _mm_loadu_ps(m+8), c3 = _mm_loadu_ps(m+12);
+		for(size_t i=beg; i<end; ++i, dst+=job.dstStride, src+=job.srcStride){
+			auto r = _mm_mul_ps(c0, _mm_set1_ps(src[0]));
+			r = VRSYSTEM_MADD(c1, _mm_set1_ps(src[1]), r);
+			r = VRSYSTEM_MADD(c2, _mm_set1_ps(src[2]), r);
+			if(W) r = _mm_add_ps(r, c3);
+			_mm_storel_pi((__m64 *)dst, r);
+			_mm_store_ss(dst+2, _mm_movehl_ps(r, r));
+		}
+	#elif defined(VRSYSTEM_NEON)
+		const auto c0 = vld1q_f32(m), c1 = vld1q_f32(m+4), c2 = vld1q_f32(m+8), c3 = vld1q_f32(m+12);
+		for(size_t i=beg; i<end; ++i, dst+=job.dstStride, src+=job.srcStride){
+			auto r = vmulq_n_f32(c0, src[0]);
+			r = vmlaq_n_f32(r, c1, src[1]);
+			r = vmlaq_n_f32(r, c2, src[2]);
+			if(W) r = vaddq_f32(r, c3);
+			vst1_f32(dst, vget_low_f32(r));
+			vst1q_lane_f32(dst+2, r, 2);
+		}
+	#else
+		for(size_t i=beg; i<end; ++i, dst+=job.dstStride, src+=job.srcStride){
+			const float x=src[0], y=src[1], z=src[2];
+			for(int k=0; k<3; ++k) dst[k] = m[k]*x + m[4+k]*y + m[8+k]*z + (W ? m[12+k] : 0.f);
+		}
+	#endif
+}
+
+template <int W>
+void transformArray(const float * m, float * dst, const float * src, size_t count, unsigned dstStride, unsigned srcStride){
+	TransformJob job = {m, dst, src, dstStride, srcStride};
+	if(count < kParallelThreshold){
+		transformRange<W>(&job, 0, count);
+	} else {
+		auto& pool = WorkerPool::get();
+		// a few chunks per thread to balance uneven progress
+		const size_t chunk = std::max(kParallelThreshold/4, count/(4*pool.numThreads()) + 1);
+		pool.run(transformRange<W>, &job, count, chunk);
+	}
+}
+
+} // anonymous namespace
+
+void Matrix4::transformPoints(float * dst, const float * src, size_t count, unsigned dstStride, unsigned srcStride) const {
+	transformArray<1>(m, dst, src, count, dstStride, srcStride);
+}
+
+void Matrix4::transformDirs(float * dst, const float * src, size_t count, unsigned dstStride, unsigned srcStride) const {
+	transformArray<0>(m, dst, src, count, dstStride, srcStride);
+}
+
+// Set quaternion from rotation matrix given element accessor R(row,col)
+template <class Get>
+static void rotationToQuat(float * q, const Get& R){
+	const float trace = R(0,0) + R(1,1) + R(2,2);
+	if(trace > 0.f){
+		const float s = 0.5f/std::sqrt(trace + 1.f);
+		q[3] = 0.25f/s;
+		q[0] = (R(2,1) - R(1,2))*s;
+		q[1] = (R(0,2) - R(2,0))*s;
+		q[2] = (R(1,0) - R(0,1))*s;
+	} else if(R(0,0) > R(1,1) && R(0,0) > R(2,2)){
+		const float s = 2.f*std::sqrt(1.f + R(0,0) - R(1,1) - R(2,2));
+		q[3] = (R(2,1) - R(1,2))/s;
+		q[0] = 0.25f*s;
+		q[1] = (R(0,1) + R(1,0))/s;
+		q[2] = (R(0,2) + R(2,0))/s;
+	} else if(R(1,1) > R(2,2)){
+		const float s = 2.f*std::sqrt(1.f + R(1,1) - R(0,0) - R(2,2));
+		q[3] = (R(0,2) - R(2,0))/s;
+		q[0] = (R(0,1) + R(1,0))/s;
+		q[1] = 0.25f*s;
+		q[2] = (R(1,2) + R(2,1))/s;
+	} else {
+		const float s = 2.f*std::sqrt(1.f + R(2,2) - R(0,0) - R(1,1));
+		q[3] = (R(1,0) - R(0,1))/s;
+		q[0] = (R(0,2) + R(2,0))/s;
+		q[1] = (R(1,2) + R(2,1))/s;
+		q[2] = 0.25f*s;
+	}
+}
+
+RigidPose& RigidPose::set(const Matrix4& m){
+	rotationToQuat(quat, [&m](int r, int c){ return m[c*4+r]; });
+	for(int i=0; i<3; ++i) pos[i] = m[12+i];
+	return normalize();
+}
+
+RigidPose RigidPose::slerp(const RigidPose& a, const RigidPose& b, float t){
+	float dot = a.quat[0]*b.quat[0] + a.quat[1]*b.quat[1] + a.quat[2]*b.quat[2] + a.quat[3]*b.quat[3];
+	const float sgn = dot < 0.f ? -1.f : 1.f; // take shortest arc
+	dot *= sgn;
+	if(dot > 0.9995f) return nlerp(a, b, t); // nearly parallel
+	const float theta = std::acos(dot);
+	const float isn = 1.f/std::sin(theta);
+	const float wa = std::sin((1.f-t)*theta)*isn;
+	const float wb = std::sin(t*theta)*isn*sgn;
+	RigidPose r;
+	for(int i=0; i<4; ++i) r.quat[i] = a.quat[i]*wa + b.quat[i]*wb;
+	for(int i=0; i<3; ++i) r.pos[i] = a.pos[i] + (b.pos[i]-a.pos[i])*t;
+	return r;
+}
+
 void printGLError(const char * note=""){
 	GLenum err = glGetError();
 	if(GL_NO_ERROR != err){
@@ -52,6 +327,37 @@ void printGLError(const char * note=""){
 
 //unsigned fromOVREye(vr::Hmd_Eye eye){ return unsigned(vr::Eye_Left!=eye); }
 
+bool hasGLExtension(const char * name){
+	#ifdef GL_NUM_EXTENSIONS
+	GLint num = 0;
+	glGetIntegerv(GL_NUM_EXTENSIONS, &num);
+	for(GLint i=0; i<num; ++i){
+		auto ext = (const char *)glGetStringi(GL_EXTENSIONS, i);
+		if(ext && !std::strcmp(ext, name)) return true;
+	}
+	return false;
+	#else
+	auto exts = (const char *)glGetString(GL_EXTENSIONS);
+	return exts && std::strstr(exts, name);
+	#endif
+}
+
+// Layout of VRStereo uniform block (std140)
+struct StereoUniforms{
+	float viewProj[2][16];
+	float view[2][16];
+	float proj[2][16];
+	int eyes[4];
+};
+
+// Foveation ring radii by manufacturer; the last entry is the default
+struct FoveationRings{ const char * manufacturer; float inner, outer; };
+const FoveationRings foveationRingsTable[] = {
+	{"HTC",   0.55f, 0.8f },	// Vive, Vive Pro (fresnel lenses blur early)
+	{"Valve", 0.65f, 0.95f},	// Index
+	{"",      0.6f,  0.85f}
+};
+
 vr::EVREye toOVREye(int eye){
 	return VRSystem::LEFT==eye ? vr::Eye_Left : vr::Eye_Right;
 }
@@ -89,6 +395,9 @@ void VRSystem::Event::print() const {
 	case UNTOUCH:
 		printf(" on %d", button);
 		break;
+	case AXIS_CHANGED:
+		printf(" on %d (%g, %g)", button, x, y);
+		break;
 	default:;
 	}
 	printf("\n");
@@ -110,15 +419,15 @@ void VRSystem::Controller::print() const {
 			printf("%c", (v>>i)&1 ? '1' : '0');
 		} printf("\n");
 	};
-	printf("buttons:       "); printBits(mButtons);
-	printf("button changes:"); printBits(mButtonChanges);
-	printf("touches:       "); printBits(mTouches);
-	printf("touch changes: "); printBits(mTouchChanges);
+	printf("buttons:       "); printBits(buttons());
+	printf("button changes:"); printBits(buttonChanges());
+	printf("touches:       "); printBits(touches());
+	printf("touch changes: "); printBits(touchChanges());
 	printf("axes:          ");
 	for(int j=0; j<5; ++j){
 		printf("(");
 		for(int i=0; i<2; ++i){
-			printf("% 3.2f ", mAxes[j][i]);
+			printf("% 3.2f ", axis(Button(AXIS0+j))[i]);
 		}
 		printf(") ");
 	} printf("\n");
@@ -132,7 +441,7 @@ int VRSystem::controllerIndex(int hand) const {
 	} else if(indices.size() == 1){ // only 1 controller
 		return indices[0]; // ignore hand, but can result in double triggers
 	}
-	return 0; // always return valid index (for accessing mControllers)
+	return 0; // always return valid index (for accessing controllers)
 }
 
 VRSystem::VRSystem(int flags)
@@ -142,11 +451,18 @@ VRSystem::VRSystem(int flags)
 	for(unsigned i=0; i < MAX_TRACKED_DEVICES; ++i){
 		auto& dev = mTrackedDevices[i];
 		dev.pose.identity();
-		dev.posePrev.identity();
 		dev.implIndex = i;
+		dev.mStates = &mInputStates;
+		dev.mIndex = i;
 	}
+	mPoseHistory.resize(MAX_TRACKED_DEVICES);
+	mPropCache.resize(PROP_CACHE_SIZE);
+	for(auto& v : mDeviceClass) v = INVALID_DEVICE;
+	for(auto& v : mDeviceRole) v = -1;
+	for(auto& v : mHiddenAreaMesh) v = vr::HiddenAreaMesh_t{NULL, 0};
 	mViewHMD.identity();
 	for(auto& v : mView) v.identity();
+	for(auto& v : mViewProj) v.identity();
 	for(auto& v : mEyeToScreen) v.identity();
 	for(auto& v : mHeadToEye) v.identity();
 	for(auto& v : mEyeToHead) v.identity();
@@ -173,8 +489,11 @@ bool VRSystem::init(){
 			return false;
 		}
 
+		mRegistryDirty = true;
+		for(auto& e : mPropCache) e.type = PROP_NONE;
+
 		for(unsigned i=0; i<vr::k_unMaxTrackedDeviceCount; ++i){
-			if(vr::TrackedDeviceClass_HMD == mImpl->GetTrackedDeviceClass(i)){
+			if(vr::TrackedDeviceClass_HMD == ovr().GetTrackedDeviceClass(i)){
 				mDevIdxHMD = i;
 				break;
 			}
@@ -196,8 +515,16 @@ bool VRSystem::init(){
 	//printf("%s %s\n", manufacturer(hmd()).c_str(), model(hmd()).c_str());
 	// Vive Pro Eye: HTC, VIVE_Pro MV
 
-	if(manufacturer(hmd()).find("HTC") != std::string::npos){
+	if(std::strstr(propertyString(hmd(), vr::Prop_ManufacturerName_String), "HTC")){
 		mUseCustomHiddenAreaMask = true;
+		mMaskDirty = true;
+	}
+
+	for(const auto& r : foveationRingsTable){
+		if(std::strstr(propertyString(hmd(), vr::Prop_ManufacturerName_String), r.manufacturer)){
+			foveationRings(r.inner, r.outer);
+			break;
+		}
 	}
 
 	{
@@ -263,15 +590,30 @@ bool VRSystem::gpuCreate(){
 	renderSize(mRenderWidth, mRenderHeight); // in case called before init
 
 	//DPRINTF("Using render target size %d x %d\n", mRenderWidth, mRenderHeight);
-	if(!mFBOLeft.create(mRenderWidth, mRenderHeight)){
-		printf("%s - Unable to create left FBO @ %d x %d\n", __FUNCTION__, mRenderWidth, mRenderHeight);
-		return false;
+	if(mEyeAtlas){
+		if(!mFBOAtlas.valid() && !mFBOAtlas.create(2*mRenderWidth, mRenderHeight)){
+			printf("%s - Unable to create atlas FBO @ %d x %d\n", __FUNCTION__, 2*mRenderWidth, mRenderHeight);
+			return false;
+		}
+	} else if(!mFBOLeft.valid()){
+		if(!mFBOLeft.create(mRenderWidth, mRenderHeight)){
+			printf("%s - Unable to create left FBO @ %d x %d\n", __FUNCTION__, mRenderWidth, mRenderHeight);
+			return false;
+		}
+		if(!mFBORight.create(mRenderWidth, mRenderHeight)){
+			printf("%s - Unable to create right FBO @ %d x %d\n", __FUNCTION__, mRenderWidth, mRenderHeight);
+			mFBOLeft.destroy();
+			return false;
+		}
 	}
-	if(!mFBORight.create(mRenderWidth, mRenderHeight)){
-		printf("%s - Unable to create right FBO @ %d x %d\n", __FUNCTION__, mRenderWidth, mRenderHeight);
-		mFBOLeft.destroy();
-		return false;
+
+	#ifdef GL_CONTEXT_PROFILE_MASK
+	{	GLint profile = 0;
+		glGetIntegerv(GL_CONTEXT_PROFILE_MASK, &profile);
+		glGetError(); // not an error before GL 3.2
+		if(profile & GL_CONTEXT_CORE_PROFILE_BIT) mCoreProfile = true;
 	}
+	#endif
 
 	// Setup matrices
 	/*for(int i=0; i<2; ++i){
@@ -287,7 +629,7 @@ VRSystem& VRSystem::renderSize(unsigned w, unsigned h, double mult){
 	if(w==0 || h==0){
 		if(valid()){
 			// Note that the recommended resolution is 1.4x native in each dimension
-			mImpl->GetRecommendedRenderTargetSize(&mRenderWidth, &mRenderHeight);
+			ovr().GetRecommendedRenderTargetSize(&mRenderWidth, &mRenderHeight);
 			//DPRINTF("Recommended render target size is %d x %d\n", mRenderWidth, mRenderHeight);
 			mRenderWidth  = mRenderWidth *mult + 0.5;
 			mRenderHeight = mRenderHeight*mult + 0.5;
@@ -306,10 +648,479 @@ void VRSystem::gpuDestroy(){
 	//if(!valid()) return;
 	mFBOLeft.destroy();
 	mFBORight.destroy();
+	mFBOAtlas.destroy();
+	mStereoFBO.destroy();
+	mCore.destroy();
+	mMaskDirty = mVigDirty = true;
+	if(mSampleQueries[0][0]){
+		glDeleteQueries(4, mSampleQueries[0]);
+		mSampleQueries[0][0] = 0;
+		mSampleQueriesUsed[0] = mSampleQueriesUsed[1] = 0;
+	}
+	mFovea.destroy();
+	mFoveaUnsupported = false;
+	if(mGpuTimerFrames[0].queries[0]){
+		for(auto& f : mGpuTimerFrames){
+			glDeleteQueries(2*MAX_GPU_MARKS, f.queries);
+			f = GpuTimerFrame();
+		}
+	}
+	mStereoUnsupported = false;
+	if(mStereoUBO){
+		glDeleteBuffers(1, &mStereoUBO);
+		mStereoUBO = 0;
+	}
+}
+
+bool VRSystem::stereoCreate(){
+	if(mStereoFBO.valid()) return true;
+	if(mStereoUnsupported) return false;
+	if(!hasGLExtension("GL_ARB_shader_viewport_layer_array") && !hasGLExtension("GL_AMD_vertex_shader_layer")){
+		DPRINTF("No vertex shader layer support; using multi-pass stereo\n");
+		mStereoUnsupported = true;
+		return false;
+	}
+	if(!mStereoFBO.create(mRenderWidth, mRenderHeight)){
+		printf("%s - Unable to create stereo FBO @ %d x %d\n", __FUNCTION__, mRenderWidth, mRenderHeight);
+		mStereoUnsupported = true;
+		return false;
+	}
+	return true;
+}
+
+bool VRSystem::foveaCreate(){
+	if(mFovea.valid()) return true;
+	if(mFoveaUnsupported) return false;
+	if(!mFovea.create()){
+		DPRINTF("Unable to create foveation shaders; shading at full density\n");
+		mFoveaUnsupported = true;
+		return false;
+	}
+	return true;
+}
+
+void VRSystem::updateFoveation(){
+	updateGaze();
+	for(int eye=0; eye<2; ++eye){
+		const auto& P = projection(eye).data();
+		auto * pat = mFovPattern[eye];
+		float r[2] = {mFovRings[0], mFovRings[1]};
+		if(mFovGaze && mGazeFresh){
+			// Margin is an angle; NDC per radian is about the focal length near the center
+			const float margin = mGazeMargin * P[0];
+			pat[0] = mGazeNDC[eye][0];
+			pat[1] = mGazeNDC[eye][1];
+			r[0] = mFovGazeRings[0] + margin;
+			r[1] = mFovGazeRings[1] + margin;
+		} else {
+			// Lens center is where the eye's forward axis projects
+			pat[0] = -P[8];
+			pat[1] = -P[9];
+		}
+		pat[2] = r[0]*r[0];
+		pat[3] = r[1]*r[1];
+	}
+}
+
+bool VRSystem::gaze(const float * dir, double sampleTime){
+	GazeSample s;
+	s.time = sampleTime;
+	for(int i=0; i<3; ++i) s.dir[i] = dir[i];
+	return mGazeQueue.push(s);
+}
+
+bool VRSystem::gazePoint(int eye, float * ndc) const {
+	if(!mGazeFresh) return false;
+	ndc[0] = mGazeNDC[eye][0];
+	ndc[1] = mGazeNDC[eye][1];
+	return true;
+}
+
+void VRSystem::updateGaze(){
+	// Track angular speed over every sample so short saccades aren't missed
+	GazeSample s;
+	while(mGazeQueue.pop(s)){
+		const auto& a = mGazeLast.dir;
+		const float la = std::sqrt(a[0]*a[0] + a[1]*a[1] + a[2]*a[2]);
+		const float ls = std::sqrt(s.dir[0]*s.dir[0] + s.dir[1]*s.dir[1] + s.dir[2]*s.dir[2]);
+		const double dt = s.time - mGazeLast.time;
+		if(la > 0.f && ls > 0.f && dt > 0. && mGazeLast.time > 0.){
+			const float c = (a[0]*s.dir[0] + a[1]*s.dir[1] + a[2]*s.dir[2]) / (la*ls);
+			mGazeSpeed = std::acos(std::min(std::max(c, -1.f), 1.f)) / dt;
+		}
+		mGazeLast = s;
+	}
+
+	const double now = time();
+	mGazeFresh = mGazeLast.time > 0. && now - mGazeLast.time <= mGazeTimeout;
+	if(!mGazeFresh){
+		mGazeMargin = 0.f;
+		return;
+	}
+
+	// The eye keeps moving from the sample until photons reach it
+	const float latency = float(now - mGazeLast.time) + 1.f/frameRate() + mVsyncToPhotons;
+	const float saccade = mGazeSpeed > mSaccadeSpeed * 0.01745329f ? mGazeSpeed * latency : 0.f;
+	const float decay = mGazeSettle > 0.f ? std::exp(-float(now - mGazeMarginTime) / mGazeSettle) : 0.f;
+	mGazeMargin = std::max(saccade, mGazeMargin * decay);
+	mGazeMarginTime = now;
+
+	for(int eye=0; eye<2; ++eye){
+		// Rotate into eye space (directions ignore the translation), then project
+		const auto& E = headToEye(eye).data();
+		const auto& P = projection(eye).data();
+		const auto& d = mGazeLast.dir;
+		float e[3];
+		for(int i=0; i<3; ++i) e[i] = E[i]*d[0] + E[4+i]*d[1] + E[8+i]*d[2];
+		const float w = P[3]*e[0] + P[7]*e[1] + P[11]*e[2];
+		if(w <= 0.f){ // behind the eye
+			mGazeFresh = false;
+			return;
+		}
+		mGazeNDC[eye][0] = (P[0]*e[0] + P[4]*e[1] + P[8]*e[2]) / w;
+		mGazeNDC[eye][1] = (P[1]*e[0] + P[5]*e[1] + P[9]*e[2]) / w;
+	}
+}
+
+void VRSystem::beginGpuFrame(){
+	readGpuTimers();
+	// Skip timing rather than wait on a frame still in flight
+	auto& f = mGpuTimerFrames[mGpuTimerFrame];
+	mGpuTiming = (mGpuTimers || mDynamicRes) && !f.pending;
+	if(!mGpuTiming) return;
+	if(!f.queries[0]){
+		for(auto& g : mGpuTimerFrames) glGenQueries(2*MAX_GPU_MARKS, g.queries);
+	}
+	f.numMarks = 0;
+}
+
+void VRSystem::endGpuFrame(){
+	if(!mGpuTiming) return;
+	auto& f = mGpuTimerFrames[mGpuTimerFrame];
+	if(!f.numMarks) return;
+	f.pending = true;
+	mGpuTimerFrame = (mGpuTimerFrame + 1) % NUM_GPU_TIMER_FRAMES;
+	mGpuTiming = false;
+}
+
+int VRSystem::beginGpuStage(GpuStage s){
+	if(!mGpuTiming) return -1;
+	auto& f = mGpuTimerFrames[mGpuTimerFrame];
+	if(f.numMarks == MAX_GPU_MARKS) return -1;
+	const int m = f.numMarks++;
+	f.stages[m] = s;
+	f.lastQuery = 2*m;
+	glQueryCounter(f.queries[2*m], GL_TIMESTAMP);
+	return m;
+}
+
+void VRSystem::endGpuStage(int m){
+	if(m < 0) return;
+	auto& f = mGpuTimerFrames[mGpuTimerFrame];
+	f.lastQuery = 2*m+1;
+	glQueryCounter(f.queries[2*m+1], GL_TIMESTAMP);
+}
+
+void VRSystem::readGpuTimers(){
+	// Read oldest frames first; results arrive a frame or two late
+	for(unsigned k=0; k<NUM_GPU_TIMER_FRAMES; ++k){
+		auto& f = mGpuTimerFrames[(mGpuTimerFrame + k) % NUM_GPU_TIMER_FRAMES];
+		if(!f.pending) continue;
+		// Queries complete in issue order, so once the last one issued (the
+		// frame's end, as stages nest) is available none of the reads stall
+		GLint ready = 0;
+		glGetQueryObjectiv(f.queries[f.lastQuery], GL_QUERY_RESULT_AVAILABLE, &ready);
+		if(!ready) break;
+		f.pending = false;
+		const unsigned slot = mGpuStatsFrames % GPU_STATS_FRAMES;
+		for(auto& v : mGpuStageMs) v[slot] = 0.f;
+		for(unsigned m=0; m<f.numMarks; ++m){
+			GLuint64 t0 = 0, t1 = 0;
+			glGetQueryObjectui64v(f.queries[2*m  ], GL_QUERY_RESULT, &t0);
+			glGetQueryObjectui64v(f.queries[2*m+1], GL_QUERY_RESULT, &t1);
+			mGpuStageMs[f.stages[m]][slot] += (t1 - t0) * 1e-6f;
+		}
+		mGpuFrameMs = mGpuStageMs[GPU_FRAME][slot];
+		mGpuFrameScale = f.resScale;
+		mGpuFrameFresh = true;
+		++mGpuStatsFrames;
+	}
+}
+
+VRSystem::GpuStats VRSystem::gpuStats() const {
+	GpuStats stats;
+	const unsigned n = std::min<unsigned long>(mGpuStatsFrames, GPU_STATS_FRAMES);
+	stats.frames = n;
+	if(!n) return stats;
+	float sorted[GPU_STATS_FRAMES];
+	for(int i=0; i<NUM_GPU_STAGES; ++i){
+		auto& st = stats.stage[i];
+		const auto * ms = mGpuStageMs[i];
+		float sum = 0.f;
+		for(unsigned k=0; k<n; ++k){
+			sum += ms[k];
+			st.max = std::max(st.max, ms[k]);
+			sorted[k] = ms[k];
+		}
+		st.mean = sum / n;
+		// Nearest rank percentile
+		auto p95 = sorted + (n*95 + 99)/100 - 1;
+		std::nth_element(sorted, p95, sorted + n);
+		st.p95 = *p95;
+	}
+	return stats;
+}
+
+bool VRSystem::readFrameTiming(){
+	mFrameTiming.m_nSize = sizeof(mFrameTiming);
+	if(!ovrCompositor().GetFrameTiming(&mFrameTiming) || mFrameTiming.m_nFrameIndex == mCompositorFrame) return false;
+	mCompositorFrame = mFrameTiming.m_nFrameIndex;
+	return true;
+}
+
+VRSystem& VRSystem::telemetry(bool v, unsigned frames){
+	if(v && !mTelemetry){
+		mTelemetryRing.assign(std::max(frames, 1u), FrameRecord());
+		mTelemetryScratch.resize(mTelemetryRing.size());
+		mFrameHealth = FrameHealth();
+	}
+	mTelemetry = v;
+	return *this;
+}
+
+void VRSystem::recordTelemetry(){
+	const auto& t = mFrameTiming;
+	auto& r = mTelemetryRing[mFrameHealth.frames % mTelemetryRing.size()];
+	r.time = t.m_flSystemTimeInSeconds;
+	r.index = t.m_nFrameIndex;
+	r.presents = t.m_nNumFramePresents;
+	r.mispresents = t.m_nNumMisPresented;
+	r.dropped = t.m_nNumDroppedFrames;
+	r.reprojection = t.m_nReprojectionFlags;
+	// Our measurements are of the previous render(), i.e., the frame just presented
+	r.ms[FRAME_CLIENT_CPU] = mClientCpuMs;
+	r.ms[FRAME_CLIENT_GPU] = t.m_flTotalRenderGpuMs - t.m_flCompositorRenderGpuMs;
+	r.ms[FRAME_COMPOSITOR_CPU] = t.m_flCompositorRenderCpuMs;
+	r.ms[FRAME_COMPOSITOR_GPU] = t.m_flCompositorRenderGpuMs;
+	r.ms[FRAME_WAIT_POSES] = mWaitPosesMs;
+	r.ms[FRAME_INTERVAL] = t.m_flClientFrameIntervalMs;
+
+	auto& h = mFrameHealth;
+	++h.frames;
+	h.dropped += r.dropped;
+	h.reprojected += r.reprojected();
+	h.mispresented += r.mispresents;
+	ovrCompositor().GetCumulativeStats(&h.compositor, sizeof(h.compositor));
+}
+
+float VRSystem::telemetryPercentile(FrameMetric m, float percent) const {
+	const unsigned n = telemetryFrames();
+	if(!n) return 0.f;
+	// Select in a buffer allocated with the ring, so querying never allocates
+	float * v = mTelemetryScratch.data();
+	for(unsigned i=0; i<n; ++i) v[i] = mTelemetryRing[i].ms[m];
+	// Nearest rank percentile
+	percent = std::min(std::max(percent, 0.f), 100.f);
+	const unsigned rank = std::max(unsigned(std::ceil(percent * 0.01f * n)), 1u);
+	std::nth_element(v, v + rank-1, v + n);
+	return v[rank-1];
+}
+
+unsigned VRSystem::telemetryHistogram(FrameMetric m, unsigned * bins, unsigned numBins, float binMs) const {
+	if(!numBins) return 0;
+	std::fill(bins, bins + numBins, 0u);
+	const unsigned n = telemetryFrames();
+	for(unsigned i=0; i<n; ++i){
+		const float b = mTelemetryRing[i].ms[m] / binMs;
+		++bins[b < numBins ? unsigned(std::max(b, 0.f)) : numBins-1];
+	}
+	return n;
+}
+
+bool VRSystem::telemetryDump(const std::string& path, bool binary) const {
+	auto file = fopen(path.c_str(), binary ? "wb" : "w");
+	if(!file){
+		DPRINTF("unable to open telemetry file %s\n", path.c_str());
+		return false;
+	}
+	const unsigned n = telemetryFrames();
+	if(binary){
+		const uint32_t header[2] = {uint32_t(sizeof(FrameRecord)), n};
+		fwrite("VRTL", 1, 4, file);
+		fwrite(header, sizeof(header), 1, file);
+	} else {
+		fprintf(file, "index,time,presents,mispresents,dropped,reprojection");
+		for(int m=0; m<NUM_FRAME_METRICS; ++m) fprintf(file, ",%s", toString(FrameMetric(m)));
+		fprintf(file, "\n");
+	}
+	for(unsigned i=n; i--;){
+		const auto& r = telemetryFrame(i);
+		if(binary){
+			fwrite(&r, sizeof(r), 1, file);
+		} else {
+			fprintf(file, "%u,%.6f,%u,%u,%u,%u", r.index, r.time, r.presents, r.mispresents, r.dropped, r.reprojection);
+			for(auto ms : r.ms) fprintf(file, ",%.3f", ms);
+			fprintf(file, "\n");
+		}
+	}
+	const bool ok = !ferror(file);
+	return (fclose(file) == 0) && ok;
+}
+
+void VRSystem::updateResolution(bool newTiming){
+	if(mDynamicRes){
+		// Timings arrive a frame or more late, so targets come from the scale
+		// the timed frame rendered at, and each timing is acted on only once
+		const float budget = mResBudget * 1000.f / frameRate();
+		float target = 1e9f;
+		bool measured = false;
+		auto limit = [&](float scale){
+			target = std::min(target, scale);
+			measured = true;
+		};
+		auto targetFrom = [&](float gpuMs, float scale){
+			// Fragment cost goes as pixel count, i.e., scale squared
+			if(gpuMs > 0.f) limit(scale * std::sqrt(budget / gpuMs));
+		};
+
+		if(mGpuFrameFresh){
+			targetFrom(mGpuFrameMs, mGpuFrameScale);
+			mGpuFrameFresh = false;
+		}
+
+		// The compositor also sees GPU work of ours outside render(). Its
+		// timing is of the frame just presented, i.e., the previous render().
+		if(newTiming){
+			const auto& timing = mFrameTiming;
+			targetFrom(timing.m_flTotalRenderGpuMs - timing.m_flCompositorRenderGpuMs, mViewScale);
+			if(timing.m_nNumFramePresents > 1 || timing.m_nNumDroppedFrames || timing.m_nReprojectionFlags){
+				limit(0.9f * mViewScale);
+			}
+		}
+
+		if(measured){
+			if(target < mResScale) mResScale += 0.5f * (target - mResScale);
+			else mResScale += std::min(target - mResScale, 0.01f);
+		}
+		mResScale = std::min(std::max(mResScale, mResRange[0]), mResRange[1]);
+	}
+
+	// Keep sizes even so foveation quads line up
+	const float s = std::min(std::max(mResScale, 0.f), 1.f);
+	mViewW = std::max(2, int(s * mRenderWidth  * 0.5f + 0.5f) * 2);
+	mViewH = std::max(2, int(s * mRenderHeight * 0.5f + 0.5f) * 2);
+	mViewW = std::min(mViewW, int(mRenderWidth));
+	mViewH = std::min(mViewH, int(mRenderHeight));
+	mViewScale = s;
+	if(mGpuTiming) mGpuTimerFrames[mGpuTimerFrame].resScale = s;
+}
+
+void VRSystem::drawFoveationMask(const int * vp){
+	GLint depthFunc = GL_LESS;
+	glGetIntegerv(GL_DEPTH_FUNC, &depthFunc);
+	glEnable(GL_DEPTH_TEST);
+	glDepthFunc(GL_ALWAYS);
+	glDepthMask(GL_TRUE);
+	glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+	glUseProgram(mFovea.mMaskProg);
+	glUniform4f(mFovea.mMaskViewport, vp[0], vp[1], vp[2], vp[3]);
+	glUniform4fv(mFovea.mMaskLens, 1, mFovPattern[mEyePass]);
+	glBindVertexArray(mFovea.mVAO);
+	glDrawArrays(GL_TRIANGLES, 0, 3);
+	glBindVertexArray(0);
+	glUseProgram(0);
+	glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+	glDepthFunc(depthFunc);
+}
+
+void VRSystem::fillFoveationGaps(const int * vp){
+	// Copy the eye so skipped quads can read their shaded neighbors
+	GLint drawBuf = 0;
+	glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &drawBuf);
+	int w = vp[0] + vp[2], h = vp[1] + vp[3];
+	if(w > mFovea.mCopyW || h > mFovea.mCopyH){
+		mFovea.mCopyW = std::max(w, mFovea.mCopyW);
+		mFovea.mCopyH = std::max(h, mFovea.mCopyH);
+		glBindTexture(GL_TEXTURE_2D, mFovea.mCopyTex);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, mFovea.mCopyW, mFovea.mCopyH, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+		glBindFramebuffer(GL_FRAMEBUFFER, mFovea.mCopyBuf);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, mFovea.mCopyTex, 0);
+	}
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, drawBuf);
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, mFovea.mCopyBuf);
+	glBlitFramebuffer(vp[0], vp[1], w, h, vp[0], vp[1], w, h, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+	glBindFramebuffer(GL_FRAMEBUFFER, drawBuf);
+
+	bool depthTest = glIsEnabled(GL_DEPTH_TEST);
+	glDisable(GL_DEPTH_TEST);
+	glUseProgram(mFovea.mFillProg);
+	glUniform4f(mFovea.mFillViewport, vp[0], vp[1], vp[2], vp[3]);
+	glUniform4fv(mFovea.mFillLens, 1, mFovPattern[mEyePass]);
+	glBindTexture(GL_TEXTURE_2D, mFovea.mCopyTex);
+	glBindVertexArray(mFovea.mVAO);
+	glDrawArrays(GL_TRIANGLES, 0, 3);
+	glBindVertexArray(0);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	glUseProgram(0);
+	if(depthTest) glEnable(GL_DEPTH_TEST);
+}
+
+void VRSystem::updateStereoUniforms(int eyes, int firstEye){
+	// Leave the binding point (and GL 3.1 calls) alone unless stereo shaders are in use
+	if(!mStereoPass && !mStereoProgramBound) return;
+	if(!mStereoUBO){
+		glGenBuffers(1, &mStereoUBO);
+		glBindBuffer(GL_UNIFORM_BUFFER, mStereoUBO);
+		glBufferData(GL_UNIFORM_BUFFER, sizeof(StereoUniforms), nullptr, GL_DYNAMIC_DRAW);
+		glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	}
+	StereoUniforms u;
+	for(int i=0; i<2; ++i){
+		std::memcpy(u.viewProj[i], viewProjection(i).data(), sizeof(u.viewProj[i]));
+		std::memcpy(u.view[i], view(i).data(), sizeof(u.view[i]));
+		std::memcpy(u.proj[i], projection(i).data(), sizeof(u.proj[i]));
+	}
+	u.eyes[0] = eyes;
+	u.eyes[1] = firstEye;
+	u.eyes[2] = u.eyes[3] = 0;
+	glBindBufferBase(GL_UNIFORM_BUFFER, mStereoBinding, mStereoUBO);
+	glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(u), &u);
+}
+
+const char * VRSystem::stereoShaderHeader(){
+	return R"(
+#extension GL_ARB_shader_viewport_layer_array : enable
+#extension GL_AMD_vertex_shader_layer : enable
+layout(std140) uniform VRStereo{
+	mat4 vrViewProj[2];
+	mat4 vrView[2];
+	mat4 vrProj[2];
+	ivec4 vrEyes; // eyes per draw, first eye
+};
+int vrEye(){ return gl_InstanceID % vrEyes.x + vrEyes.y; }
+int vrInstance(){ return gl_InstanceID / vrEyes.x; }
+vec4 vrPosition(vec4 worldPos){
+	int eye = vrEye();
+	#if defined(GL_ARB_shader_viewport_layer_array) || defined(GL_AMD_vertex_shader_layer)
+	gl_Layer = eye;
+	#endif
+	return vrViewProj[eye] * worldPos;
+}
+)";
+}
+
+void VRSystem::stereoBindProgram(unsigned program) const {
+	auto block = glGetUniformBlockIndex(program, "VRStereo");
+	if(GL_INVALID_INDEX != block){
+		glUniformBlockBinding(program, block, mStereoBinding);
+		mStereoProgramBound = true;
+	}
 }
 
 void VRSystem::shutdown(){
 	if(valid()){
+		stopPoseSampler();
+		stopHaptics();
 		stopCamera();
 		vr::VR_Shutdown();
 		mImpl = NULL;
@@ -317,13 +1128,7 @@ void VRSystem::shutdown(){
 }
 
 float VRSystem::frameRate() const {
-	if(valid() && mDevIdxHMD>=0){
-		vr::ETrackedPropertyError err;
-		auto v = mImpl->GetFloatTrackedDeviceProperty(mDevIdxHMD, vr::Prop_DisplayFrequency_Float, &err);
-		if(vr::TrackedProp_Success == err) return v;
-		//printf("%d\n", err);
-	}
-	return 90.f; // TODO: let user specify this
+	return mFrameRate; // from device registry
 }
 
 void VRSystem::updateVigMesh(){
@@ -341,6 +1146,7 @@ void VRSystem::updateVigMesh(){
 	mVigPos.clear();
 	mVigCol.clear();
 	mVigInd.clear();
+	mVigDirty = true;
 
 	float r1=mVigRad, r2=mVigRad+mVigFade, r3=2.;
 
@@ -366,175 +1172,449 @@ void VRSystem::updateVigMesh(){
 	addInd(1, 2);
 }
 
-void VRSystem::render(std::function<void (void)> userDraw){
-	if(!active()){ // no VR, just call draw function with current state
-		userDraw();
-		return;
+namespace{
+
+// Custom hidden area masks (triangle strips)
+const float customMaskR = 1.; // mask radius (Vive, Vive Pro)
+//const float customMaskR = 1.19; // mask radius (Index)
+const char customMaskEllipse[] = {93,0, 127,0, 97,27, 127,34, 89,51, 127,73, 71,73, 127,127, 47,89, 73,127, 19,99, 34,127, -10,103, 0,127, -40,99, -34,127, -67,89, -73,127, -91,73, -127,127, -109,51, -127,73, -121,27, -127,34, -124,0, -127,0, -121,-27, -127,-34, -109,-51, -127,-73, -91,-73, -127,-127, -67,-89, -73,-127, -40,-99, -34,-127, -10,-103, 0,-127, 19,-99, 34,-127, 47,-89, 73,-127, 71,-73, 127,-127, 89,-51, 127,-73, 97,-27, 127,-34, 93,0, 127,0};
+
+const char rl=-117, rr=97, rb=-94, rt=114; // Vive Pro w/ min lens-to-eye
+const char customMaskRect[] = {rl,rb, -127,-127, rr,rb, 127,-127, rr,rt, 127,127, rl,rt, -127,127, rl,rb, -127,-127};
+
+const float cs = customMaskR/127.;
+const float customMaskMV[] = {
+	 cs,0,0,0, 0,cs,0,0, 0,0,cs,0, 0,0,-1,1,
+	-cs,0,0,0, 0,cs,0,0, 0,0,cs,0, 0,0,-1,1,
+};
+
+// Get custom mask vertices as floats (GL_BYTE is not a valid vertex array type)
+// Returns the number of vertices; dst must hold 2*CUSTOM_MASK_MAX_VERTS floats
+enum{ CUSTOM_MASK_MAX_VERTS = 64 };
+int customMask(VRSystem::Shape shape, float * dst){
+	const char * src = customMaskEllipse;
+	int num = sizeof(customMaskEllipse);
+	switch(shape){
+	case VRSystem::RECT: src = customMaskRect; num = sizeof(customMaskRect); break;
+	default:;
 	}
+	for(int i=0; i<num; ++i) dst[i] = src[i];
+	return num/2;
+}
 
-	if(!mFBOLeft.valid()) gpuCreate(); // Ensure FBOs are created
-
-	bool updatePosesBeforeRender = false;
-
-	// In the comment for WaitGetPoses, it says to call at the last minute before rendering. This does appear to work best in practice, however, any poses used before this call are one frame behind the ones used for render. The OpenVR example updates the poses after present to fix the delay, but calling WaitGetPoses after render introduces jitter.
-	if(updatePosesBeforeRender || mFirstRender) updatePoses();
-
-	pushViewport(); // Push current viewport since it's global!
-	glDisable(GL_SCISSOR_TEST);
+// Note: the OpenVR mask seems to be rather conservative
+const float openVRMaskMV[] = {2,0,0,0, 0,2,0,0, 0,0,2,0, -1,-1,-1,1};
 
-	/*
-	vr::Compositor_FrameTiming timing;
-	timing.m_nSize = sizeof(timing);
-	if(vr::VRCompositor()->GetFrameTiming(&timing)){
-		printf("frame presents: %u\n", timing.m_nNumFramePresents);
-	}//*/
+}
 
-	auto renderEye = [this, &userDraw](int eye, const FBO& fbo){
-		mEyePass = eye;
-		#ifdef MULTISAMPLING
-			glEnable(GL_MULTISAMPLE);
-			glBindFramebuffer(GL_FRAMEBUFFER, fbo.mRenderBuf);
-		#else
-			glBindFramebuffer(GL_FRAMEBUFFER, fbo.mResolveBuf);
-		#endif
-		//printGLError("glBindFramebuffer in render");
-		glViewport(0, 0, mRenderWidth, mRenderHeight);
-		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+void VRSystem::drawHiddenAreaMask(){
+	// The mask lies on the near plane. Writing its depth makes the scene fail
+	// the depth test there before any shading.
+	GLint depthFunc = GL_LESS;
+	glGetIntegerv(GL_DEPTH_FUNC, &depthFunc);
+	if(MASK_DEPTH == mMaskMode){
+		glEnable(GL_DEPTH_TEST);
+		glDepthFunc(GL_ALWAYS);
+		glDepthMask(GL_TRUE);
+	} else {
+		glDisable(GL_DEPTH_TEST);
+	}
+	drawHiddenAreaMesh();
+	glDepthFunc(depthFunc);
+}
 
-		if(mHiddenAreaMask && !(mLeftPresent && (LEFT==mEyePass))){
-			//glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE); // for no color write
-			glMatrixMode(GL_PROJECTION);
-			glLoadIdentity();
-			glMatrixMode(GL_MODELVIEW);
-			glPushMatrix();
-			glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
-			glColor4ub(mBackground[0],mBackground[1],mBackground[2],255);
-			//glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE); glColor4ub(255,0,0,255); // red mask debug
+void VRSystem::drawHiddenAreaMesh(){
+	if(mCoreProfile){
+		glUseProgram(mCore.mMeshProg);
+		glUniformMatrix4fv(mCore.mMeshMVP, 1, GL_FALSE, mUseCustomHiddenAreaMask ? customMaskMV + (LEFT==mEyePass ? 0 : 16) : openVRMaskMV);
+		glUniform4f(mCore.mMeshColor, mBackground[0]/255.f, mBackground[1]/255.f, mBackground[2]/255.f, 1.f);
+		glVertexAttrib4f(1, 1.f, 1.f, 1.f, 1.f); // mask color comes from uniform
+		glBindVertexArray(mCore.mMaskVAO[mEyePass]);
+		glDrawArrays(mUseCustomHiddenAreaMask ? GL_TRIANGLE_STRIP : GL_TRIANGLES, 0, mCore.mMaskCount[mEyePass]);
+		glBindVertexArray(0);
+		glUseProgram(0);
+		return;
+	}
 
-			if(mUseCustomHiddenAreaMask){
-				static const float R = 1.; // mask radius (Vive, Vive Pro)
-				//static const float R = 1.19; // mask radius (Index)
-				static const char ellipse[] = {93,0, 127,0, 97,27, 127,34, 89,51, 127,73, 71,73, 127,127, 47,89, 73,127, 19,99, 34,127, -10,103, 0,127, -40,99, -34,127, -67,89, -73,127, -91,73, -127,127, -109,51, -127,73, -121,27, -127,34, -124,0, -127,0, -121,-27, -127,-34, -109,-51, -127,-73, -91,-73, -127,-127, -67,-89, -73,-127, -40,-99, -34,-127, -10,-103, 0,-127, 19,-99, 34,-127, 47,-89, 73,-127, 71,-73, 127,-127, 89,-51, 127,-73, 97,-27, 127,-34, 93,0, 127,0};
-				
-				static const char rl=-117, rr=97, rb=-94, rt=114; // Vive Pro w/ min lens-to-eye
-				static const char rect[] = {rl,rb, -127,-127, rr,rb, 127,-127, rr,rt, 127,127, rl,rt, -127,127, rl,rb, -127,-127};
-				
-				static const float s = R/127.;
-				static const float mv[] = {
-					 s,0,0,0, 0,s,0,0, 0,0,s,0, 0,0,-1,1,
-					-s,0,0,0, 0,s,0,0, 0,0,s,0, 0,0,-1,1,
-				};
-
-				const auto * verts = ellipse;
-				int vertBytes = sizeof(ellipse);
-				switch(mMaskShape){
-				case RECT: verts=rect; vertBytes=sizeof(rect); break;
-				}
+	//glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE); // for no color write
+	glMatrixMode(GL_PROJECTION);
+	glLoadIdentity();
+	glMatrixMode(GL_MODELVIEW);
+	glPushMatrix();
+	glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+	glColor4ub(mBackground[0],mBackground[1],mBackground[2],255);
+	//glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE); glColor4ub(255,0,0,255); // red mask debug
+
+	if(mUseCustomHiddenAreaMask){
+		float verts[2*CUSTOM_MASK_MAX_VERTS];
+		int numVerts = customMask(mMaskShape, verts);
+		glLoadMatrixf(customMaskMV + (LEFT==mEyePass ? 0 : 16));
+		glEnableClientState(GL_VERTEX_ARRAY);
+		glVertexPointer(2, GL_FLOAT, 0, (const GLvoid *)verts);
+		glDrawArrays(GL_TRIANGLE_STRIP, 0, numVerts);
+		glDisableClientState(GL_VERTEX_ARRAY);
 
-				glLoadMatrixf(mv + (LEFT==mEyePass ? 0 : 16));
-				glEnableClientState(GL_VERTEX_ARRAY);
-				glVertexPointer(2, GL_BYTE, 0, (const GLvoid *)verts);
-				glDrawArrays(GL_TRIANGLE_STRIP, 0, vertBytes/sizeof(verts[0])/2);
-				glDisableClientState(GL_VERTEX_ARRAY);
-
-			} else {
-				// Note: the OpenVR mask seems to be rather conservative
-				static const float mv[] = {2,0,0,0, 0,2,0,0, 0,0,2,0, -1,-1,-1,1};
-				glLoadMatrixf(mv);
-				auto hiddenAreaMesh = mImpl->GetHiddenAreaMesh(toOVREye(mEyePass));
-				if(NULL != hiddenAreaMesh.pVertexData){
-					//DPRINTF("%d\n", hiddenAreaMesh.unTriangleCount);
-					if(0){
-						for(int i=0; i<hiddenAreaMesh.unTriangleCount; ++i){
-							const auto& a = hiddenAreaMesh.pVertexData[i*3];
-							const auto& b = hiddenAreaMesh.pVertexData[i*3+1];
-							const auto& c = hiddenAreaMesh.pVertexData[i*3+2];
-							printf("[%2d]: (%f %f) (%f %f) (%f %f)\n", i, a.v[0], a.v[1], b.v[0], b.v[1], c.v[0], c.v[1]);
-						}
-					}
-					glEnableClientState(GL_VERTEX_ARRAY);
-					glVertexPointer(2, GL_FLOAT, 0, (const GLvoid *)hiddenAreaMesh.pVertexData);
-					glDrawArrays(GL_TRIANGLES, 0, 3*hiddenAreaMesh.unTriangleCount);
-					glDisableClientState(GL_VERTEX_ARRAY);
+	} else {
+		glLoadMatrixf(openVRMaskMV);
+		const auto& hiddenAreaMesh = mHiddenAreaMesh[mEyePass];
+		if(NULL != hiddenAreaMesh.pVertexData){
+			//DPRINTF("%d\n", hiddenAreaMesh.unTriangleCount);
+			if(0){
+				for(int i=0; i<hiddenAreaMesh.unTriangleCount; ++i){
+					const auto& a = hiddenAreaMesh.pVertexData[i*3];
+					const auto& b = hiddenAreaMesh.pVertexData[i*3+1];
+					const auto& c = hiddenAreaMesh.pVertexData[i*3+2];
+					printf("[%2d]: (%f %f) (%f %f) (%f %f)\n", i, a.v[0], a.v[1], b.v[0], b.v[1], c.v[0], c.v[1]);
 				}
-				/*struct HiddenAreaMesh_t{
-					const HmdVector2_t *pVertexData;
-					uint32_t unTriangleCount;
-				};
-				struct HmdVector2_t{ float v[2]; };*/
 			}
-
-			glPopMatrix();
-			//glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE); // for no color write
+			glEnableClientState(GL_VERTEX_ARRAY);
+			glVertexPointer(2, GL_FLOAT, 0, (const GLvoid *)hiddenAreaMesh.pVertexData);
+			glDrawArrays(GL_TRIANGLES, 0, 3*hiddenAreaMesh.unTriangleCount);
+			glDisableClientState(GL_VERTEX_ARRAY);
 		}
+		/*struct HiddenAreaMesh_t{
+			const HmdVector2_t *pVertexData;
+			uint32_t unTriangleCount;
+		};
+		struct HmdVector2_t{ float v[2]; };*/
+	}
 
-		glEnable(GL_DEPTH_TEST);
-		glMatrixMode(GL_PROJECTION);
-			// Apply view here so we don't have to pre-multiply the modelview which req's a fetch.
-			// This will only mess up the deprecated gl_* matrix built-ins in GLSL.
-			glLoadMatrixf((projection() * view()).data());
-			//glLoadMatrixf(projection().get());
-		glMatrixMode(GL_MODELVIEW);
-			glPushMatrix();
-			/* Pre-multiply modelview by HMD view
-			Matrix4 mv;
-			glGetFloatv(GL_MODELVIEW_MATRIX, mv.get());
-			glLoadMatrixf((viewHMD() * mv).get());
-			//*/
-			if(mOverrideFixedModelView) glLoadIdentity();
-			userDraw();
-
-			if(mVigRad < 1.8){ // exact threshold will depend on lens
-				glMatrixMode(GL_PROJECTION);
-				glPushMatrix();
-				glLoadIdentity();
-				glMatrixMode(GL_MODELVIEW);
-				glPushMatrix();
-				float dx = eyeToHead()[12]*2.;
-				float mv[] = {1,0,0,0, 0,1,0,0, 0,0,1,0, dx,0,0,1};
-				glLoadMatrixf(mv);
-				glDepthMask(GL_FALSE);
-				glEnable(GL_BLEND);
-				glBlendEquation(GL_FUNC_ADD);
-				//glBlendFunc(GL_DST_COLOR, GL_ZERO); // multiplicative
-				glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA); // transparent (so we can blend custom color)
-
-				glEnableClientState(GL_VERTEX_ARRAY);
-				glVertexPointer(2, GL_FLOAT, 0, (const GLvoid *)(&mVigPos[0]));
-				glEnableClientState(GL_COLOR_ARRAY);
-				//glColorPointer(3, GL_UNSIGNED_BYTE, 0, (const GLvoid *)(&mVigCol[0]));
-				glColorPointer(4, GL_UNSIGNED_BYTE, 0, (const GLvoid *)(&mVigCol[0]));
-				glDrawElements(GL_TRIANGLE_STRIP, mVigInd.size(), GL_UNSIGNED_BYTE, (const GLvoid *)(&mVigInd[0]));
-				glDisableClientState(GL_VERTEX_ARRAY);
-				glDisableClientState(GL_COLOR_ARRAY);
-				glDepthMask(GL_TRUE);
-				glDisable(GL_BLEND);
-				glMatrixMode(GL_PROJECTION);
-				glPopMatrix();
-				glMatrixMode(GL_MODELVIEW);
-				glPopMatrix();
-			}
-
-			glPopMatrix();
-		glBindFramebuffer(GL_FRAMEBUFFER, 0);
-		#ifdef MULTISAMPLING
-			// Downsample render buffer into resolve buffer (which goes to HMD)
-			glDisable(GL_MULTISAMPLE);
-			glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo.mRenderBuf);
-			glBindFramebuffer(GL_DRAW_FRAMEBUFFER, fbo.mResolveBuf);
-			glBlitFramebuffer(0, 0, mRenderWidth, mRenderHeight, 0, 0, mRenderWidth, mRenderHeight, 
-				GL_COLOR_BUFFER_BIT,
-				GL_LINEAR);
-			glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
-			glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
-		#endif
-	};
+	glPopMatrix();
+	//glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE); // for no color write
+}
 
-	renderEye(LEFT , mFBOLeft );
-	renderEye(RIGHT, mFBORight);
+void VRSystem::drawVignette(){
+	float dx = eyeToHead()[12]*2.;
+
+	if(mCoreProfile){
+		const float mvp[] = {1,0,0,0, 0,1,0,0, 0,0,1,0, dx,0,0,1};
+		glUseProgram(mCore.mMeshProg);
+		glUniformMatrix4fv(mCore.mMeshMVP, 1, GL_FALSE, mvp);
+		glUniform4f(mCore.mMeshColor, 1.f, 1.f, 1.f, 1.f);
+		glDepthMask(GL_FALSE);
+		glEnable(GL_BLEND);
+		glBlendEquation(GL_FUNC_ADD);
+		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+		glBindVertexArray(mCore.mVigVAO);
+		glDrawElements(GL_TRIANGLE_STRIP, mCore.mVigCount, GL_UNSIGNED_BYTE, nullptr);
+		glBindVertexArray(0);
+		glDepthMask(GL_TRUE);
+		glDisable(GL_BLEND);
+		glUseProgram(0);
+		return;
+	}
 
-	//glEnable(GL_SCISSOR_TEST);
-	popViewport();
+	glMatrixMode(GL_PROJECTION);
+	glPushMatrix();
+	glLoadIdentity();
+	glMatrixMode(GL_MODELVIEW);
+	glPushMatrix();
+	float mv[] = {1,0,0,0, 0,1,0,0, 0,0,1,0, dx,0,0,1};
+	glLoadMatrixf(mv);
+	glDepthMask(GL_FALSE);
+	glEnable(GL_BLEND);
+	glBlendEquation(GL_FUNC_ADD);
+	//glBlendFunc(GL_DST_COLOR, GL_ZERO); // multiplicative
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA); // transparent (so we can blend custom color)
+
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glVertexPointer(2, GL_FLOAT, 0, (const GLvoid *)(&mVigPos[0]));
+	glEnableClientState(GL_COLOR_ARRAY);
+	//glColorPointer(3, GL_UNSIGNED_BYTE, 0, (const GLvoid *)(&mVigCol[0]));
+	glColorPointer(4, GL_UNSIGNED_BYTE, 0, (const GLvoid *)(&mVigCol[0]));
+	glDrawElements(GL_TRIANGLE_STRIP, mVigInd.size(), GL_UNSIGNED_BYTE, (const GLvoid *)(&mVigInd[0]));
+	glDisableClientState(GL_VERTEX_ARRAY);
+	glDisableClientState(GL_COLOR_ARRAY);
+	glDepthMask(GL_TRUE);
+	glDisable(GL_BLEND);
+	glMatrixMode(GL_PROJECTION);
+	glPopMatrix();
+	glMatrixMode(GL_MODELVIEW);
+	glPopMatrix();
+}
+
+void VRSystem::beginSampleCount(int eye){
+	if(!mCountSamples) return;
+	if(!mSampleQueries[0][0]) glGenQueries(4, mSampleQueries[0]);
+	glBeginQuery(GL_SAMPLES_PASSED, mSampleQueries[mSampleFrame][eye]);
+	mSampleQueriesUsed[mSampleFrame] |= 1<<eye;
+}
+
+void VRSystem::endSampleCount(){
+	if(mCountSamples) glEndQuery(GL_SAMPLES_PASSED);
+}
+
+void VRSystem::readSampleCounts(){
+	// Read last frame's queries, which have had a frame to finish
+	mSampleFrame ^= 1;
+	auto& used = mSampleQueriesUsed[mSampleFrame];
+	if(!used) return;
+	const auto * queries = mSampleQueries[mSampleFrame];
+	unsigned long sum = 0;
+	for(int eye=0; eye<2; ++eye){
+		if(!(used & (1<<eye))) continue;
+		GLuint ready = 0;
+		glGetQueryObjectuiv(queries[eye], GL_QUERY_RESULT_AVAILABLE, &ready);
+		if(!ready) return; // try again next frame
+		GLuint samples = 0;
+		glGetQueryObjectuiv(queries[eye], GL_QUERY_RESULT, &samples);
+		sum += samples;
+	}
+	mSamplesDrawn = sum;
+	used = 0;
+}
+
+void VRSystem::pushFixedView(){
+	if(mCoreProfile) return;
+	glMatrixMode(GL_PROJECTION);
+		// Apply view here so we don't have to pre-multiply the modelview which req's a fetch.
+		// This will only mess up the deprecated gl_* matrix built-ins in GLSL.
+		glLoadMatrixf(viewProjection().data());
+		//glLoadMatrixf(projection().get());
+	glMatrixMode(GL_MODELVIEW);
+		glPushMatrix();
+		/* Pre-multiply modelview by HMD view
+		Matrix4 mv;
+		glGetFloatv(GL_MODELVIEW_MATRIX, mv.get());
+		glLoadMatrixf((viewHMD() * mv).get());
+		//*/
+		if(mOverrideFixedModelView) glLoadIdentity();
+}
+
+void VRSystem::popFixedView(){
+	if(!mCoreProfile) glPopMatrix();
+}
+
+void VRSystem::updateCoreMeshes(){
+	if(!mCore.valid() && !mCore.create()) return;
+
+	if(mMaskDirty){
+		mMaskDirty = false;
+		for(int eye=0; eye<2; ++eye){
+			float buf[2*CUSTOM_MASK_MAX_VERTS];
+			const float * verts = buf;
+			unsigned count = 0;
+			if(mUseCustomHiddenAreaMask){
+				count = customMask(mMaskShape, buf);
+			} else if(mHiddenAreaMesh[eye].pVertexData){
+				verts = mHiddenAreaMesh[eye].pVertexData[0].v;
+				count = 3*mHiddenAreaMesh[eye].unTriangleCount;
+			}
+			glBindBuffer(GL_ARRAY_BUFFER, mCore.mMaskVBO[eye]);
+			glBufferData(GL_ARRAY_BUFFER, count*2*sizeof(float), count ? verts : nullptr, GL_STATIC_DRAW);
+			mCore.mMaskCount[eye] = count;
+		}
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+	}
+
+	if(mVigDirty){
+		mVigDirty = false;
+		glBindBuffer(GL_ARRAY_BUFFER, mCore.mVigVBO[0]);
+		glBufferData(GL_ARRAY_BUFFER, mVigPos.size()*sizeof(mVigPos[0]), mVigPos.data(), GL_STATIC_DRAW);
+		glBindBuffer(GL_ARRAY_BUFFER, mCore.mVigVBO[1]);
+		glBufferData(GL_ARRAY_BUFFER, mVigCol.size()*sizeof(mVigCol[0]), mVigCol.data(), GL_STATIC_DRAW);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		glBindVertexArray(mCore.mVigVAO);
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, mVigInd.size()*sizeof(mVigInd[0]), mVigInd.data(), GL_STATIC_DRAW);
+		glBindVertexArray(0);
+		mCore.mVigCount = mVigInd.size();
+	}
+}
+
+void VRSystem::renderFrame(DrawFunc userDraw, void * userDrawCtx){
+	if(!active()){ // no VR, just call draw function with current state
+		userDraw(userDrawCtx);
+		return;
+	}
+
+	if(!gpuReady()) gpuCreate(); // Ensure FBOs are created
+
+	mRenderStart = time();
+
+	bool updatePosesBeforeRender = false;
+
+	// In the comment for WaitGetPoses, it says to call at the last minute before rendering. This does appear to work best in practice, however, any poses used before this call are one frame behind the ones used for render. The OpenVR example updates the poses after present to fix the delay, but calling WaitGetPoses after render introduces jitter.
+	if(updatePosesBeforeRender || mFirstRender) updatePoses();
+	else if(mPredictPoses) updatePredictedPoses();
+
+	// After poses, since the first pose update fetches the hidden area mesh
+	if(mCoreProfile) updateCoreMeshes();
+	beginGpuFrame();
+	const bool newTiming = (mDynamicRes || mTelemetry) && readFrameTiming();
+	if(newTiming && mTelemetry) recordTelemetry();
+	updateResolution(newTiming);
+	if(mFoveation) updateFoveation();
+
+	pushViewport(); // Push current viewport since it's global!
+	glDisable(GL_SCISSOR_TEST);
+
+	const auto frameTimer = beginGpuStage(GPU_FRAME);
+
+	auto bindFBO = [](const FBO& fbo){
+		#ifdef MULTISAMPLING
+			glEnable(GL_MULTISAMPLE);
+			glBindFramebuffer(GL_FRAMEBUFFER, fbo.mRenderBuf);
+		#else
+			glBindFramebuffer(GL_FRAMEBUFFER, fbo.mResolveBuf);
+		#endif
+		//printGLError("glBindFramebuffer in render");
+	};
+
+	auto resolveFBO = [](const FBO& fbo, int w, int h){
+		#ifdef MULTISAMPLING
+			// Downsample render buffer into resolve buffer (which goes to HMD)
+			glDisable(GL_MULTISAMPLE);
+			glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo.mRenderBuf);
+			glBindFramebuffer(GL_DRAW_FRAMEBUFFER, fbo.mResolveBuf);
+			glBlitFramebuffer(0, 0, w, h, 0, 0, w, h, 
+				GL_COLOR_BUFFER_BIT,
+				GL_LINEAR);
+			glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+			glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+		#else
+			(void)fbo; (void)w; (void)h;
+		#endif
+	};
+
+	// In the atlas, both eyes share one bind and clear
+	auto renderEye = [this, userDraw, userDrawCtx, bindFBO, resolveFBO](int eye, const FBO& fbo){
+		mEyePass = eye;
+		int vp[4];
+		eyeViewport(eye, vp);
+		if(!mEyeAtlas){
+			auto t = beginGpuStage(GPU_CLEAR);
+			bindFBO(fbo);
+			glViewport(vp[0], vp[1], vp[2], vp[3]);
+			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+			endGpuStage(t);
+		} else {
+			glViewport(vp[0], vp[1], vp[2], vp[3]);
+		}
+
+		if(mHiddenAreaMask && !(mLeftPresent && (LEFT==mEyePass))){
+			auto t = beginGpuStage(GPU_MASK);
+			drawHiddenAreaMask();
+			endGpuStage(t);
+		}
+		const bool fovea = mFoveation && foveaCreate();
+		if(fovea){
+			auto t = beginGpuStage(GPU_FOVEATION);
+			drawFoveationMask(vp);
+			endGpuStage(t);
+		}
+
+		glEnable(GL_DEPTH_TEST);
+		pushFixedView();
+			updateStereoUniforms(1, eye);
+			auto t = beginGpuStage(GpuStage(GPU_DRAW_LEFT + eye));
+			beginSampleCount(eye);
+			userDraw(userDrawCtx);
+			endSampleCount();
+			endGpuStage(t);
+			if(fovea){
+				t = beginGpuStage(GPU_FOVEATION);
+				fillFoveationGaps(vp);
+				endGpuStage(t);
+			}
+
+			if(mVigRad < 1.8){ // exact threshold will depend on lens
+				t = beginGpuStage(GPU_VIGNETTE);
+				drawVignette();
+				endGpuStage(t);
+			}
+
+		popFixedView();
+		if(!mEyeAtlas){
+			glBindFramebuffer(GL_FRAMEBUFFER, 0);
+			t = beginGpuStage(GPU_RESOLVE);
+			resolveFBO(fbo, vp[2], vp[3]);
+			endGpuStage(t);
+		}
+	};
+
+	// Single pass: the fixed pipeline can't route to layers, so the mask and
+	// vignette are drawn per layer around one draw call into both layers.
+	auto renderStereo = [this, userDraw, userDrawCtx](){
+		int layerVP[4];
+		eyeViewport(LEFT, layerVP);
+		const bool fovea = mFoveation && foveaCreate();
+		for(int eye=0; eye<2; ++eye){
+			mEyePass = eye;
+			auto t = beginGpuStage(GPU_CLEAR);
+			glBindFramebuffer(GL_FRAMEBUFFER, mStereoFBO.mLayerBuf[eye]);
+			glViewport(0, 0, layerVP[2], layerVP[3]);
+			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+			endGpuStage(t);
+			if(mHiddenAreaMask && !(mLeftPresent && (LEFT==mEyePass))){
+				t = beginGpuStage(GPU_MASK);
+				drawHiddenAreaMask();
+				endGpuStage(t);
+			}
+			if(fovea){
+				t = beginGpuStage(GPU_FOVEATION);
+				drawFoveationMask(layerVP);
+				endGpuStage(t);
+			}
+		}
+
+		mEyePass = LEFT;
+		glBindFramebuffer(GL_FRAMEBUFFER, mStereoFBO.mLayeredBuf);
+		glEnable(GL_DEPTH_TEST);
+		pushFixedView();
+			updateStereoUniforms(2, LEFT);
+			auto t = beginGpuStage(GPU_DRAW_LEFT);
+			beginSampleCount(LEFT);
+			userDraw(userDrawCtx);
+			endSampleCount();
+			endGpuStage(t);
+		popFixedView();
+
+		for(int eye=0; eye<2; ++eye){
+			mEyePass = eye;
+			glBindFramebuffer(GL_FRAMEBUFFER, mStereoFBO.mLayerBuf[eye]);
+			if(fovea){
+				t = beginGpuStage(GPU_FOVEATION);
+				fillFoveationGaps(layerVP);
+				endGpuStage(t);
+			}
+			if(mVigRad < 1.8){
+				t = beginGpuStage(GPU_VIGNETTE);
+				drawVignette();
+				endGpuStage(t);
+			}
+			// Copy layer to eye texture for submission
+			int vp[4];
+			eyeViewport(eye, vp);
+			t = beginGpuStage(GPU_RESOLVE);
+			glBindFramebuffer(GL_DRAW_FRAMEBUFFER, mEyeAtlas ? mFBOAtlas.mResolveBuf : (LEFT==eye ? mFBOLeft : mFBORight).mResolveBuf);
+			glBlitFramebuffer(0, 0, vp[2], vp[3], vp[0], vp[1], vp[0]+vp[2], vp[1]+vp[3],
+				GL_COLOR_BUFFER_BIT, GL_NEAREST);
+			endGpuStage(t);
+		}
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	};
+
+	mStereoPass = SINGLE_PASS_STEREO == mStereoMode && stereoCreate();
+	if(mStereoPass){
+		renderStereo();
+	} else if(mEyeAtlas){
+		auto t = beginGpuStage(GPU_CLEAR);
+		bindFBO(mFBOAtlas);
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		endGpuStage(t);
+		renderEye(LEFT , mFBOAtlas);
+		renderEye(RIGHT, mFBOAtlas);
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		t = beginGpuStage(GPU_RESOLVE);
+		resolveFBO(mFBOAtlas, 2*mRenderWidth, mRenderHeight);
+		endGpuStage(t);
+	} else {
+		renderEye(LEFT , mFBOLeft );
+		renderEye(RIGHT, mFBORight);
+	}
+
+	//glEnable(GL_SCISSOR_TEST);
+	popViewport();
 
 	// Send render textures over to HMD
 	auto sendTexToHMD = [this](int eye, const FBO& fbo){
@@ -542,14 +1622,21 @@ void VRSystem::render(std::function<void (void)> userDraw){
 		auto colorSpace = vr::ColorSpace_Gamma;
 		//auto colorSpace = vr::ColorSpace_Linear;
 		vr::Texture_t eyeTex = {(void*)(uintptr_t)fbo.mResolveTex, vr::TextureType_OpenGL, colorSpace};
-		vr::VRTextureBounds_t texBounds = {0,0,1,1}; // umin, vmin, umax, vmax
-		if(vr::VRCompositorError_None != vr::VRCompositor()->Submit(toOVREye(eye), &eyeTex, &texBounds)){
+		float b[4];
+		eyeBounds(eye, b);
+		vr::VRTextureBounds_t texBounds = {b[0],b[1],b[2],b[3]}; // umin, vmin, umax, vmax
+		if(vr::VRCompositorError_None != ovrCompositor().Submit(toOVREye(eye), &eyeTex, &texBounds)){
 			DPRINTF("error submitting eye texture to HMD\n");
 		}
 	};
 
-	sendTexToHMD(LEFT , mFBOLeft );
-	sendTexToHMD(RIGHT, mFBORight);
+	auto submitTimer = beginGpuStage(GPU_SUBMIT);
+	sendTexToHMD(LEFT , mEyeAtlas ? mFBOAtlas : mFBOLeft );
+	sendTexToHMD(RIGHT, mEyeAtlas ? mFBOAtlas : mFBORight);
+	endGpuStage(submitTimer);
+	endGpuStage(frameTimer);
+	endGpuFrame();
+	mClientCpuMs = (time() - mRenderStart) * 1000.;
 	//printGLError("sendTexToHMD"); // FIXME: throwing GL error "GL_INVALID_OPERATION" here
 
 	// vr::IVRCompositor::Submit recommends to call glFlush after submitting both eyes
@@ -567,11 +1654,54 @@ void VRSystem::render(std::function<void (void)> userDraw){
 	// OpenVR example updates poses after render commands AND the window buffer swap:
 	// https://github.com/ValveSoftware/openvr/blob/5aa6c5f0f6520c59c4dce124541ecc62604fd7a5/samples/hellovr_opengl/hellovr_opengl_main.cpp#L847
 	if(!updatePosesBeforeRender) updatePoses();
+
+	if(mInputPump) pumpInput(mInputPumpFilter);
 	
 	mFirstRender = false;
+
+	readSampleCounts();
+
+	const auto calls = runtimeCalls();
+	mRuntimeCallsPerFrame = calls - mRuntimeCallsFrameStart;
+	mRuntimeCallsFrameStart = calls;
+
+	const auto allocs = allocations();
+	mAllocsPerFrame = allocs - mAllocsFrameStart;
+	mAllocsFrameStart = allocs;
+	++mFramesRendered;
+	#ifdef VRSYSTEM_COUNT_ALLOCS
+	// First frames create GPU resources and fill caches
+	if(mAllocsPerFrame && mFramesRendered > 3){
+		DPRINTF("Frame %lu made %u heap allocations\n", mFramesRendered, mAllocsPerFrame);
+	}
+	#endif
 }
 
-void VRSystem::drawTexture(unsigned tex, float sx, float sy, float ax, float ay) const {
+void VRSystem::drawTexture(unsigned tex, float sx, float sy, float ax, float ay, const float * bounds) const {
+	static const float fullBounds[] = {0.f, 0.f, 1.f, 1.f};
+	const auto& B = bounds ? bounds : fullBounds;
+	if(mCoreProfile){
+		if(!mCore.valid() && !mCore.create()) return;
+		float l = -1.f + 2.f*ax;
+		float b = -1.f + 2.f*ay;
+		glDepthMask(GL_FALSE);
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_2D, tex);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+		glUseProgram(mCore.mTexProg);
+		glUniform4f(mCore.mTexRect, l, b, l + 2.f*sx, b + 2.f*sy);
+		glUniform4fv(mCore.mTexBounds, 1, B);
+		glUniform1f(mCore.mTexBright, mBright);
+		glBindVertexArray(mCore.mQuadVAO);
+		glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+		glBindVertexArray(0);
+		glUseProgram(0);
+		glDepthMask(GL_TRUE);
+		return;
+	}
+
 	//printf("VRSystem::drawTexture(%d)\n", tex);
 	//GLint vp[4];
 	//glGetIntegerv(GL_VIEWPORT, vp);
@@ -595,7 +1725,7 @@ void VRSystem::drawTexture(unsigned tex, float sx, float sy, float ax, float ay)
 	float r = l + 2.f*sx;
 	float t = b + 2.f*sy;
 	float quadVerts[] = { l,b, r,b, l,t, r,t };
-	float quadTexCoords[] = { 0,0, 1,0, 0,1, 1,1 };
+	float quadTexCoords[] = { B[0],B[1], B[2],B[1], B[0],B[3], B[2],B[3] };
 	glEnableClientState(GL_VERTEX_ARRAY);
 	glVertexPointer(2, GL_FLOAT, 0, quadVerts);
 	glEnableClientState(GL_TEXTURE_COORD_ARRAY);
@@ -621,7 +1751,30 @@ void VRSystem::drawTexture(unsigned tex, float sx, float sy, float ax, float ay)
 
 void VRSystem::drawFrameBuffer(int eye, float sx, float sy, float ax, float ay) const {
 	if(!active()) return;
-	drawTexture(eye==LEFT ? mFBOLeft.mResolveTex : mFBORight.mResolveTex, sx,sy, ax,ay);
+	float b[4];
+	eyeBounds(eye, b);
+	if(mEyeAtlas){
+		drawTexture(mFBOAtlas.mResolveTex, sx,sy, ax,ay, b);
+	} else {
+		drawTexture(eye==LEFT ? mFBOLeft.mResolveTex : mFBORight.mResolveTex, sx,sy, ax,ay, b);
+	}
+}
+
+void VRSystem::eyeViewport(int eye, int * xywh) const {
+	xywh[0] = mEyeAtlas && RIGHT==eye ? mRenderWidth : 0;
+	xywh[1] = 0;
+	xywh[2] = mViewW ? mViewW : mRenderWidth;
+	xywh[3] = mViewH ? mViewH : mRenderHeight;
+}
+
+void VRSystem::eyeBounds(int eye, float * b) const {
+	int vp[4];
+	eyeViewport(eye, vp);
+	const float W = mEyeAtlas ? 2*mRenderWidth : mRenderWidth;
+	b[0] = vp[0] / W;
+	b[1] = 0.f;
+	b[2] = (vp[0] + vp[2]) / W;
+	b[3] = float(vp[3]) / mRenderHeight;
 }
 
 void VRSystem::drawFrameBufferAspect(int eye, float width, float height) const {
@@ -631,7 +1784,10 @@ void VRSystem::drawFrameBufferAspect(int eye, float width, float height) const {
 }
 
 VRSystem& VRSystem::eyeDistScale(float v){
-	mEyeDistScale = v;
+	if(v != mEyeDistScale){
+		mEyeDistScale = v;
+		mEyeDirty = true;
+	}
 	return *this;
 }
 /*VRSystem& VRSystem::eyeDist(float v){
@@ -647,7 +1803,7 @@ VRSystem& VRSystem::eyeDistScale(float v){
 VRSystem& VRSystem::near(float v){
 	if(v != mNear){
 		mNear = v;
-		//for(int i=0; i<2; ++i) mEyeToScreen[i] = eyeToScreen(i);
+		mEyeDirty = true;
 	}
 	return *this;
 }
@@ -655,7 +1811,7 @@ VRSystem& VRSystem::near(float v){
 VRSystem& VRSystem::far(float v){
 	if(v != mFar){
 		mFar = v;
-		//for(int i=0; i<2; ++i) mEyeToScreen[i] = eyeToScreen(i);
+		mEyeDirty = true;
 	}
 	return *this;
 }
@@ -701,22 +1857,26 @@ void VRSystem::popViewport(){
 	glViewport(mViewport[0], mViewport[1], mViewport[2], mViewport[3]);
 }
 
-void VRSystem::updatePoses(){
-	if(!valid()) return;
+void VRSystem::updateDeviceRegistry(){
+	mRegistryDirty = false;
 
 	// Sort generic indices into class specific ones
 	vr::ETrackedDeviceClass ovrDevClasses[] = {vr::TrackedDeviceClass_HMD, vr::TrackedDeviceClass_Controller, vr::TrackedDeviceClass_GenericTracker, vr::TrackedDeviceClass_TrackingReference};
 
 	vr::TrackedDeviceIndex_t ovrIndices[MAX_TRACKED_DEVICES];
 
+	for(auto& v : mDeviceClass) v = INVALID_DEVICE;
+	for(auto& v : mDeviceRole) v = -1;
+
 	for(auto ovrDevClass : ovrDevClasses){
-		int numIndices = mImpl->GetSortedTrackedDeviceIndicesOfClass(ovrDevClass, ovrIndices, MAX_TRACKED_DEVICES);
+		int numIndices = ovr().GetSortedTrackedDeviceIndicesOfClass(ovrDevClass, ovrIndices, MAX_TRACKED_DEVICES);
 		auto devType = fromOVRDeviceClass(ovrDevClass);
 		//printf("Dev type %d has a count of %d\n", devType, numIndices);
 		auto& indices = mDeviceIndices[devType];
 		indices.clear();
 		for(int i=0; i<numIndices; ++i){
 			indices.push_back(ovrIndices[i]);
+			mDeviceClass[ovrIndices[i]] = devType;
 		}
 	}
 
@@ -737,15 +1897,67 @@ void VRSystem::updatePoses(){
 		} printf("\n");
 	}//*/
 
+	for(auto i : mDeviceIndices[CONTROLLER]){
+		switch(ovr().GetControllerRoleForTrackedDeviceIndex(i)){
+		case vr::TrackedControllerRole_LeftHand:  mDeviceRole[i] = LEFT; break;
+		case vr::TrackedControllerRole_RightHand: mDeviceRole[i] = RIGHT; break;
+		default:;
+		}
+		if(mDeviceRole[i] >= 0) mInputStates.hand[i] = mDeviceRole[i];
+	}
+
+	// Update hand to controller number table
+	for(int i=0; i<2; ++i){
+		auto deviceIdx = ovr().GetTrackedDeviceIndexForControllerRole(toOVRControllerRole(i));
+		if(vr::k_unTrackedDeviceIndexInvalid != deviceIdx){
+			mHandToDevice[i] = deviceIdx;
+		}
+		//printf("hand %d assigned to device %d\n", i, deviceIdx);
+	}
+
+	// HMD display properties
+	if(!mDeviceIndices[HMD].empty()){
+		mDevIdxHMD = mDeviceIndices[HMD][0];
+		auto v = propertyFloat(mDevIdxHMD, vr::Prop_DisplayFrequency_Float);
+		if(v > 0.f) mFrameRate = v;
+		mVsyncToPhotons = propertyFloat(mDevIdxHMD, vr::Prop_SecondsFromVsyncToPhotons_Float);
+		for(int i=0; i<2; ++i) mHiddenAreaMesh[i] = ovr().GetHiddenAreaMesh(toOVREye(i));
+		mEyeDirty = true;
+		mMaskDirty = true;
+	}
+}
+
+void VRSystem::updatePoses(){
+	if(!valid()) return;
+
+	if(mRegistryDirty) updateDeviceRegistry();
+
 	// Get poses of all attached devices
-	vr::VRCompositor()->WaitGetPoses(mTrackedDevicePoses, MAX_TRACKED_DEVICES, NULL, 0);
+	const double waitStart = time();
+	ovrCompositor().WaitGetPoses(mTrackedDevicePoses, MAX_TRACKED_DEVICES, NULL, 0);
+	mWaitPosesMs = (time() - waitStart) * 1000.;
+
+	// WaitGetPoses predicts poses to when the next frame's photons are displayed
+	const double poseTime = time() + secondsToPhotons();
+
+	// Tracking references are static so only refresh their absolute poses
+	// occasionally. Their world poses still follow the parent every frame.
+	const bool updateRefs = poseTime - mRefPoseTime >= mRefPoseInterval;
+	if(updateRefs) mRefPoseTime = poseTime;
 
 	for(unsigned i=0; i < MAX_TRACKED_DEVICES; ++i){
 
 		auto& dev = mTrackedDevices[i];
 
-		if(mTrackedDevicePoses[i].bPoseIsValid){	
-			dev.updatePose(toMatrix4(mTrackedDevicePoses[i].mDeviceToAbsoluteTracking), mParentPose);
+		const auto& ovrPose = mTrackedDevicePoses[i];
+		dev.trackingResult = ovrPose.eTrackingResult;
+
+		if(ovrPose.bPoseIsValid){
+			const bool cachedRef = TRACKING_REFERENCE == dev.type && !updateRefs;
+			dev.updatePose(cachedRef ? dev.poseAbs : toRigidPose(ovrPose.mDeviceToAbsoluteTracking), mParentRigid);
+			mPoseHistory[i].add(poseTime, dev.poseRigid);
+			mParentRigid.rotate(dev.vel, ovrPose.vVelocity.v);
+			mParentRigid.rotate(dev.angVel, ovrPose.vAngularVelocity.v);
 
 			/* Warn about bad pose values (just a sanity check, should never happen)
 			for(auto v : dev.pose.m){
@@ -754,7 +1966,8 @@ void VRSystem::updatePoses(){
 				}
 			}//*/
 
-			dev.type = fromOVRDeviceClass(mImpl->GetTrackedDeviceClass(i));
+			// Device with a pose that was not registered is of a class we don't handle
+			dev.type = INVALID_DEVICE != mDeviceClass[i] ? mDeviceClass[i] : UNKNOWN_DEVICE;
 			//printf("%s\n", toString(dev.type));
 
 			//if(vr::k_unTrackedDeviceIndex_Hmd == i){
@@ -775,12 +1988,6 @@ void VRSystem::updatePoses(){
 					}
 				}*/
 
-				mControllers[i] = dev;
-				switch(mImpl->GetControllerRoleForTrackedDeviceIndex(i)){
-				case vr::TrackedControllerRole_LeftHand:  mControllers[i].mHand = LEFT; break;
-				case vr::TrackedControllerRole_RightHand: mControllers[i].mHand = RIGHT; break;
-				default:;
-				}
 				
 			}
 
@@ -796,8 +2003,9 @@ void VRSystem::updatePoses(){
 	// and m_mat4HMDPose is actually hmdPose^-1 !!!
 
 	// Update matrices
-	for(int i=0; i<2; ++i){
-		mEyeToScreen[i] = toMatrix4(mImpl->GetProjectionMatrix(toOVREye(i), mNear, mFar));
+	// Projection and eye offsets only change with clip planes, IPD or eye scale
+	for(int i=0; mEyeDirty && i<2; ++i){
+		mEyeToScreen[i] = toMatrix4(ovr().GetProjectionMatrix(toOVREye(i), mNear, mFar));
 
 		// GetProjectionMatrix appears to have a mistake.
 		// The near distance works out to be half of what is specified.
@@ -813,13 +2021,21 @@ void VRSystem::updatePoses(){
 		* Normally View and Eye^-1 will be multiplied together and treated as View in your application. 
 		*/
 		// Presumably, 'Eye' in above is result of GetEyeToHeadTransform.
-		mHeadToEye[i] = toMatrix4(mImpl->GetEyeToHeadTransform(toOVREye(i)));
+		mHeadToEye[i] = toMatrix4(ovr().GetEyeToHeadTransform(toOVREye(i)));
 			//printf("mHeadToEye (eye %d) =\n", eye); mHeadToEye[i].print();
 		mHeadToEye[i].pos()[0] *= mEyeDistScale;
-		mEye[i] = (poseHMD() * mHeadToEye[i]).pos();
 		mEyeToHead[i] = mHeadToEye[i].inverseRigid(); // could be faster, but do this for safety
-		mView[i] = mEyeToHead[i] * mViewHMD;
 	}
+	mEyeDirty = false;
+
+	for(int i=0; i<2; ++i){
+		Matrix4::transformAffine(mEye[i].data(), poseHMD().data(), mHeadToEye[i].pos().data());
+		mEye[i].w = 1.f;
+		Matrix4::multiply<Matrix4::AFFINE, Matrix4::AFFINE>(mView[i], mEyeToHead[i], mViewHMD);
+		Matrix4::multiply<Matrix4::PERSPECTIVE, Matrix4::AFFINE>(mViewProj[i], mEyeToScreen[i], mView[i]);
+	}
+
+	publishPoseSnapshot();
 
 	// Experiments with proj:
 		/* Orthographic (flat and close)
@@ -870,6 +2086,216 @@ void VRSystem::updatePoses(){
 
 }
 
+void VRSystem::publishPoseSnapshot(){
+	// Only the render thread writes, so relaxed loads of our own state suffice
+	const unsigned idx = (mPoseSnapshotLatest.load(std::memory_order_relaxed) + 1) % NUM_POSE_SNAPSHOTS;
+	auto& slot = mPoseSnapshots[idx];
+	const unsigned seq = slot.seq.load(std::memory_order_relaxed);
+	slot.seq.store(seq+1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	auto& snap = slot.data;
+	for(unsigned i=0; i < MAX_TRACKED_DEVICES; ++i){
+		snap.pose[i] = mTrackedDevices[i].pose;
+		snap.type[i] = mTrackedDevices[i].type;
+	}
+	snap.viewHMD = mViewHMD;
+	snap.parent = mParentRigid;
+	for(int i=0; i<2; ++i){
+		snap.view[i] = mView[i];
+		snap.viewProj[i] = mViewProj[i];
+		snap.handToDevice[i] = mDeviceIndices[CONTROLLER].empty() ? -1 : controllerIndex(i);
+	}
+	snap.frame = ++mPoseFrame;
+
+	slot.seq.store(seq+2, std::memory_order_release);
+	mPoseSnapshotLatest.store(idx, std::memory_order_release);
+}
+
+bool VRSystem::PoseHistory::poseAt(RigidPose& dst, double time, bool slerp) const {
+	if(empty()) return false;
+	if(time <= oldest().time){ dst = oldest().pose; return true; }
+	if(time >= newest().time){ dst = newest().pose; return true; }
+
+	// Find first pose later than time; it is neither the oldest nor past the newest
+	unsigned lo = 1, hi = mSize-1;
+	while(lo < hi){
+		unsigned mid = (lo + hi) / 2;
+		if((*this)[mid].time > time) hi = mid;
+		else lo = mid+1;
+	}
+
+	const auto& a = (*this)[lo-1];
+	const auto& b = (*this)[lo];
+	const float t = (time - a.time) / (b.time - a.time);
+	dst = slerp ? RigidPose::slerp(a.pose, b.pose, t) : RigidPose::nlerp(a.pose, b.pose, t);
+	return true;
+}
+
+const VRSystem::PoseHistory& VRSystem::poseHistory(int device) const {
+	if(device < 0 || device >= MAX_TRACKED_DEVICES) device = 0;
+	return mPoseHistory[device];
+}
+
+bool VRSystem::poseAt(int device, double time, RigidPose& dst, bool slerp) const {
+	return poseHistory(device).poseAt(dst, time, slerp);
+}
+
+Matrix4 VRSystem::poseAt(int device, double time) const {
+	RigidPose p;
+	if(poseAt(device, time, p)) return p.toMatrix4();
+	return poseDevice(device);
+}
+
+template <class Reader>
+bool VRSystem::readPoseSnapshot(Reader read) const {
+	// The writer must lap the whole ring during one read to force a retry,
+	// so a few attempts are all that is ever needed.
+	for(int attempt=0; attempt < NUM_POSE_SNAPSHOTS; ++attempt){
+		const auto& slot = mPoseSnapshots[mPoseSnapshotLatest.load(std::memory_order_acquire)];
+		const unsigned seq = slot.seq.load(std::memory_order_acquire);
+		if(seq & 1) continue;
+		read(slot.data);
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if(slot.seq.load(std::memory_order_relaxed) == seq) return true;
+	}
+	return false;
+}
+
+bool VRSystem::poseSnapshot(PoseSnapshot& dst) const {
+	return readPoseSnapshot([&dst](const PoseSnapshot& s){ dst = s; });
+}
+
+double VRSystem::time(){
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+struct VRSystem::PoseSampler{
+	// Latest sample of one device, guarded by a sequence counter (odd while writing)
+	struct Latest{
+		std::atomic<unsigned> seq{0};
+		PoseSample sample;
+	};
+
+	vr::IVRSystem * impl;
+	double period;
+	std::atomic<bool> running{true};
+	Latest latest[MAX_TRACKED_DEVICES];
+	SPSCRing<PoseSample, POSE_SAMPLE_BUFFER> samples[MAX_TRACKED_DEVICES];
+	std::thread thread;
+
+	PoseSampler(vr::IVRSystem * impl_, double period_): impl(impl_), period(period_){}
+
+	void run(const VRSystem& vrs){
+		using Clock = std::chrono::steady_clock;
+		const auto dt = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(period));
+		const auto space = vr::VRCompositor()->GetTrackingSpace();
+		vr::TrackedDevicePose_t poses[MAX_TRACKED_DEVICES];
+		RigidPose parent;
+		auto next = Clock::now();
+
+		while(running.load(std::memory_order_relaxed)){
+			impl->GetDeviceToAbsoluteTrackingPose(space, 0.f, poses, MAX_TRACKED_DEVICES);
+			const double t = time();
+			// If the render thread kept the snapshot busy, the parent may be
+			// torn; keep the previous samples for this tick
+			const bool parentValid = vrs.readPoseSnapshot([&parent](const PoseSnapshot& s){ parent = s.parent; });
+
+			if(parentValid){
+				for(unsigned i=0; i < MAX_TRACKED_DEVICES; ++i){
+					const auto& p = poses[i];
+					if(!p.bDeviceIsConnected || !p.bPoseIsValid) continue;
+					PoseSample smp;
+					smp.time = t;
+					smp.pose = parent * toRigidPose(p.mDeviceToAbsoluteTracking);
+					parent.rotate(smp.vel, p.vVelocity.v);
+					parent.rotate(smp.angVel, p.vAngularVelocity.v);
+
+					auto& l = latest[i];
+					const unsigned seq = l.seq.load(std::memory_order_relaxed);
+					l.seq.store(seq+1, std::memory_order_relaxed);
+					std::atomic_thread_fence(std::memory_order_release);
+					l.sample = smp;
+					l.seq.store(seq+2, std::memory_order_release);
+
+					samples[i].push(smp);
+				}
+			}
+
+			// Skip missed ticks rather than sampling in a burst to catch up
+			next += dt;
+			const auto now = Clock::now();
+			if(next < now) next = now;
+			std::this_thread::sleep_until(next);
+		}
+	}
+};
+
+bool VRSystem::startPoseSampler(float rateHz){
+	if(!valid() || !vr::VRCompositor() || rateHz <= 0.f) return false;
+	stopPoseSampler();
+	mPoseSampler = new PoseSampler(mImpl, 1./rateHz);
+	mPoseSampler->thread = std::thread([this](){ mPoseSampler->run(*this); });
+	return true;
+}
+
+void VRSystem::stopPoseSampler(){
+	if(mPoseSampler){
+		mPoseSampler->running = false;
+		mPoseSampler->thread.join();
+		delete mPoseSampler;
+		mPoseSampler = nullptr;
+	}
+}
+
+bool VRSystem::latestPoseSample(int device, PoseSample& dst) const {
+	if(!mPoseSampler || device < 0 || device >= MAX_TRACKED_DEVICES) return false;
+	const auto& l = mPoseSampler->latest[device];
+	// The sampler writes a device at most once per period, so this rarely spins
+	for(;;){
+		const unsigned seq = l.seq.load(std::memory_order_acquire);
+		if(0 == seq) return false; // never sampled
+		if(seq & 1) continue;
+		dst = l.sample;
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if(l.seq.load(std::memory_order_relaxed) == seq) return true;
+	}
+}
+
+bool VRSystem::popPoseSample(int device, PoseSample& dst){
+	if(!mPoseSampler || device < 0 || device >= MAX_TRACKED_DEVICES) return false;
+	return mPoseSampler->samples[device].pop(dst);
+}
+
+float VRSystem::secondsToPhotons() const {
+	if(!valid()) return 0.f;
+	float sinceVsync = 0.f;
+	ovr().GetTimeSinceLastVsync(&sinceVsync, NULL);
+	return 1.f/frameRate() - sinceVsync + mVsyncToPhotons;
+}
+
+Matrix4 VRSystem::predictedPose(int device, float secondsAhead) const {
+	if(device < 0 || device >= MAX_TRACKED_DEVICES) return Matrix4().identity();
+	if(!valid()) return poseDevice(device);
+	vr::TrackedDevicePose_t poses[MAX_TRACKED_DEVICES];
+	ovr().GetDeviceToAbsoluteTrackingPose(ovrCompositor().GetTrackingSpace(), secondsAhead, poses, device+1);
+	if(!poses[device].bPoseIsValid) return poseDevice(device);
+	return (mParentRigid * toRigidPose(poses[device].mDeviceToAbsoluteTracking)).toMatrix4();
+}
+
+void VRSystem::updatePredictedPoses(){
+	if(!valid()) return;
+	// A single runtime call gets all devices predicted to photon time
+	vr::TrackedDevicePose_t poses[MAX_TRACKED_DEVICES];
+	ovr().GetDeviceToAbsoluteTrackingPose(ovrCompositor().GetTrackingSpace(), secondsToPhotons(), poses, MAX_TRACKED_DEVICES);
+	for(unsigned i=0; i < MAX_TRACKED_DEVICES; ++i){
+		auto& dev = mTrackedDevices[i];
+		if((CONTROLLER == dev.type || TRACKER == dev.type) && poses[i].bPoseIsValid){
+			dev.setPose(toRigidPose(poses[i].mDeviceToAbsoluteTracking), mParentRigid);
+		}
+	}
+}
+
 unsigned VRSystem::numTrackedDevice(DeviceType t, unsigned maxNum) const {
 	int N = mDeviceIndices[t].size();
 	return N < maxNum ? N : maxNum;
@@ -883,7 +2309,7 @@ const VRSystem::Controller& VRSystem::controller(int hand) const {
 	return const_cast<VRSystem*>(this)->controller(hand);
 }
 VRSystem::Controller& VRSystem::controller(int hand){
-	return mControllers[controllerIndex(hand)];
+	return mTrackedDevices[controllerIndex(hand)];
 }
 
 unsigned VRSystem::numControllers(unsigned maxNum) const {
@@ -915,158 +2341,370 @@ const Matrix4& VRSystem::poseController(int hand) const {
 	return poseDevice(controllerIndex(hand));
 }
 
-bool VRSystem::pollEvent(){ //DPRINTF("\n");
-	if(!valid()) return false;
+bool VRSystem::updateInput(unsigned device){
+	vr::VRControllerState_t state;
+	if(ovr().GetControllerState(device, &state, sizeof(state))){
+		if(state.unPacketNum != mInputPacketNums[device]){
+			mInputPacketNums[device] = state.unPacketNum;
+			mInputStates.setButtons(device, state.ulButtonPressed);
+			mInputStates.setTouches(device, state.ulButtonTouched);
+			for(int i=0; i<InputStates::MAX_AXES; ++i){
+				mInputStates.setAxis(device, i, state.rAxis[i].x, state.rAxis[i].y);
+			}
+			return true;
+		}
+	}
+	return false;
+}
 
-	auto updateControllerState = [this](int devIndex){
-		vr::VRControllerState_t state;
-		if(mImpl->GetControllerState(devIndex, &state, sizeof(state))){
-			if(state.unPacketNum != mControllerStates[devIndex].unPacketNum){
-				mControllerStates[devIndex] = state;
-				mControllers[devIndex].setButtons(state.ulButtonPressed);
-				mControllers[devIndex].setTouches(state.ulButtonTouched);
-				for(int i=0; i<Controller::MAX_AXES; ++i){
-					mControllers[devIndex].setAxis(i, state.rAxis[i].x, state.rAxis[i].y);
-				}
+void VRSystem::translateEvent(const vr::VREvent_t& src, Event& dst){
+	auto devIndex = src.trackedDeviceIndex;
+	auto type = vr::EVREventType(src.eventType);
 
-				/* Calc number of clicks
-				If time betwee current click and last click is below threshold, then add to number of clicks.
-				clickTimer -= dt;
-				if(button clicked){
-					if(clickTimer < 0){
-						clicks = 0;
-					} else {
-						clicks++;
-						clickTimer = threshold;
-					}
-				}
-				*/
+	// The registry is rebuilt once after the queue is drained, so a burst of
+	// device changes only costs one rebuild. Only a new device's class is
+	// needed right away.
+	switch(type){
+	case vr::VREvent_TrackedDeviceActivated:
+		if(devIndex < MAX_TRACKED_DEVICES){
+			mDeviceClass[devIndex] = fromOVRDeviceClass(ovr().GetTrackedDeviceClass(devIndex));
+		}
+		// fall through
+	case vr::VREvent_TrackedDeviceDeactivated:
+		invalidateProperties(devIndex);
+		// fall through
+	case vr::VREvent_TrackedDeviceRoleChanged:
+		mRegistryDirty = true;
+		break;
+	case vr::VREvent_PropertyChanged:
+		invalidateProperty(devIndex, src.data.property.prop);
+		switch(src.data.property.prop){
+		case vr::Prop_DisplayFrequency_Float:
+		case vr::Prop_SecondsFromVsyncToPhotons_Float:
+			mRegistryDirty = true; break;
+		default:;
+		}
+		break;
+	case vr::VREvent_IpdChanged:
+		mEyeDirty = true;
+		break;
+	default:;
+	}
 
-				return true;
-			}
+	dst.deviceType = deviceClass(devIndex);
+	dst.deviceIndex = devIndex;
+	dst.age = src.eventAgeSeconds; // relative age of event
+	dst.time = time() - dst.age;
+	//VREvent_Data_t data = src.data;
+	//printf("class %d [%d]: %s\n", devClass, devIndex, toString(type));
+
+	switch(type){
+	case vr::VREvent_TrackedDeviceActivated:
+		dst.type = ACTIVATED;
+		break;
+	case vr::VREvent_TrackedDeviceDeactivated:
+		dst.type = DEACTIVATED;
+		break;
+	case vr::VREvent_TrackedDeviceRoleChanged:
+		dst.type = ROLE_CHANGED;
+		break;
+	case vr::VREvent_TrackedDeviceUserInteractionStarted:
+		dst.type = INTERACTION_STARTED;
+		break;
+	case vr::VREvent_TrackedDeviceUserInteractionEnded:
+		dst.type = INTERACTION_ENDED;
+		break;
+	case vr::VREvent_ButtonPress:
+		dst.type = BUTTON_DOWN;
+		dst.button = src.data.controller.button;
+		break;
+	case vr::VREvent_ButtonUnpress:
+		dst.type = BUTTON_UP;
+		dst.button = src.data.controller.button;
+		break;
+	case vr::VREvent_ButtonTouch:
+		dst.type = TOUCH;
+		dst.button = src.data.controller.button;
+		break;
+	case vr::VREvent_ButtonUntouch:
+		dst.type = UNTOUCH;
+		dst.button = src.data.controller.button;
+		break;
+	default:
+		dst.type = (decltype(dst.type))(type);		
+	}
+
+	// Automatic actions for specific devices
+	switch(dst.deviceType){
+	case CONTROLLER:{
+		// Ensure local controller state is synced
+		/*if(updateControllerState(devIndex)){
+			// Ensure the continuous control triggers its own event
+			mControllerStates[devIndex].unPacketNum--;
+		}*/
+
+		// Set role?
+		// TrackedControllerRole_LeftHand, TrackedControllerRole_RightHand, TrackedControllerRole_Invalid
+		//auto ctrlRole = mImpl->GetControllerRoleForTrackedDeviceIndex(devIndex);
+	} break;
+	case HMD:{
+		switch(dst.type){
+		case BUTTON_DOWN: mWearingHMD=true; break;
+		case BUTTON_UP: mWearingHMD=false; break;
+		default:;
 		}
-		return false;
-	};
+	} break;
+	default:;
+	}
+}
 
-	// Poll discrete events (buttons, touch, status changes, etc.)
-	if(mImpl->PollNextEvent(&mVREvent, sizeof(mVREvent))){
-		auto devIndex = mVREvent.trackedDeviceIndex;
-		auto devClass = mImpl->GetTrackedDeviceClass(devIndex);
-		auto type = vr::EVREventType(mVREvent.eventType);
-
-		mEvent.deviceType = fromOVRDeviceClass(devClass);
-		mEvent.deviceIndex = devIndex;
-		mEvent.age = mVREvent.eventAgeSeconds; // relative age of event
-		//VREvent_Data_t data = mVREvent.data;
-		//printf("class %d [%d]: %s\n", devClass, devIndex, toString(type));
-
-		switch(type){
-		case vr::VREvent_TrackedDeviceActivated:
-			mEvent.type = ACTIVATED;
-			break;
-		case vr::VREvent_TrackedDeviceDeactivated:
-			mEvent.type = DEACTIVATED;
-			break;
-		case vr::VREvent_TrackedDeviceRoleChanged:
-			mEvent.type = ROLE_CHANGED;
-			break;
-		case vr::VREvent_TrackedDeviceUserInteractionStarted:
-			mEvent.type = INTERACTION_STARTED;
-			break;
-		case vr::VREvent_TrackedDeviceUserInteractionEnded:
-			mEvent.type = INTERACTION_ENDED;
-			break;
-		case vr::VREvent_ButtonPress:
-			mEvent.type = BUTTON_DOWN;
-			mEvent.button = mVREvent.data.controller.button;
-			break;
-		case vr::VREvent_ButtonUnpress:
-			mEvent.type = BUTTON_UP;
-			mEvent.button = mVREvent.data.controller.button;
-			break;
-		case vr::VREvent_ButtonTouch:
-			mEvent.type = TOUCH;
-			mEvent.button = mVREvent.data.controller.button;
-			break;
-		case vr::VREvent_ButtonUntouch:
-			mEvent.type = UNTOUCH;
-			mEvent.button = mVREvent.data.controller.button;
-			break;
-		default:
-			mEvent.type = (decltype(mEvent.type))(type);		
-		}
-
-		// Automatic actions for specific devices
-		switch(mEvent.deviceType){
-		case CONTROLLER:{
-			// Ensure local controller state is synced
-			/*if(updateControllerState(devIndex)){
-				// Ensure the continuous control triggers its own event
-				mControllerStates[devIndex].unPacketNum--;
-			}*/
-
-			// Set role?
-			// TrackedControllerRole_LeftHand, TrackedControllerRole_RightHand, TrackedControllerRole_Invalid
-			//auto ctrlRole = mImpl->GetControllerRoleForTrackedDeviceIndex(devIndex);
-		} break;
-		case HMD:{
-			switch(mEvent.type){
-			case BUTTON_DOWN: mWearingHMD=true; break;
-			case BUTTON_UP: mWearingHMD=false; break;
-			default:;
+void VRSystem::updateInputs(bool pushAxisEvents){
+	if(mRegistryDirty) updateDeviceRegistry();
+
+	// Update the local controller states
+	// Clear changes since they should be one-offs
+	mInputStates.clearChanges();
+
+	// Trackers are included for their pogo pin inputs
+	for(auto devType : {CONTROLLER, TRACKER})
+	for(auto i : mDeviceIndices[devType]){
+		if(updateInput(i) && pushAxisEvents){
+			Event e;
+			e.type = AXIS_CHANGED;
+			e.deviceType = mDeviceClass[i];
+			e.deviceIndex = i;
+			e.age = 0.f;
+			e.time = time();
+			for(unsigned a=0; a<InputStates::MAX_AXES; ++a){
+				const auto * d = mInputStates.axisChanges[a][i];
+				if(d[0]==0.f && d[1]==0.f) continue;
+				e.button = AXIS0 + a;
+				e.x = mInputStates.axes[a][i][0];
+				e.y = mInputStates.axes[a][i][1];
+				pushEvent(e);
 			}
-		} break;
-		default:;
 		}
+	}
 
-		return true;
+	mInputStates.updateGestures(time());
+}
+
+bool VRSystem::pushEvent(const Event& e){
+	if(mInputQueue.push(e)){ ++mPushedEvents; return true; }
+	mDroppedEvents.fetch_add(1, std::memory_order_relaxed);
+	return false;
+}
+
+size_t VRSystem::pumpInput(EventMask filter){
+	if(!valid()) return 0;
+
+	const auto pushed = mPushedEvents;
+	Event e;
+	while(ovr().PollNextEvent(&mVREvent, sizeof(mVREvent))){
+		translateEvent(mVREvent, e);
+		if(eventCategory(e.type) & filter) pushEvent(e);
 	}
 
-	// If we made it here, we are done processing events...
+	updateInputs(filter & AXIS_EVENTS);
+	return mPushedEvents - pushed;
+}
 
-	// Update hand to controller number table
-	// Note this will be behind by one empty of the event queue, but it seems like the only reasonable place to call it.
-	for(int i=0; i<2; ++i){
-		// Note that GetTrackedDeviceIndexForControllerRole should not be called in performance sensitive sections
-		auto deviceIdx = mImpl->GetTrackedDeviceIndexForControllerRole(toOVRControllerRole(i));
-		if(vr::k_unTrackedDeviceIndexInvalid != deviceIdx){
-			mHandToDevice[i] = deviceIdx;
-		}
-		//printf("hand %d assigned to device %d\n", i, deviceIdx);
+bool VRSystem::pollEvent(){ //DPRINTF("\n");
+	if(!valid()) return false;
+
+	// Poll discrete events (buttons, touch, status changes, etc.)
+	if(ovr().PollNextEvent(&mVREvent, sizeof(mVREvent))){
+		translateEvent(mVREvent, mEvent);
+		return true;
 	}
 
+	// If we made it here, we are done processing events...
+
 	//DPRINTF("updatePoses\n");
 	// FIXME: seems like it needs to be called just before render to avoid stalling
 	//updatePoses();
 
-	// Update the local controller states
-	for(unsigned i=0; i<vr::k_unMaxTrackedDeviceCount; ++i){
-		auto devClass = mImpl->GetTrackedDeviceClass(i);
-		if(vr::TrackedDeviceClass_Controller == devClass){
-
-			// Clear changes since they should be one-offs
-			mControllers[i].mButtonChanges = 0;
-			mControllers[i].mTouchChanges = 0;
-
-			if(updateControllerState(i)){
-				// Trigger an axis event---how to get axis number????
-				/*mEvent.type = AXIS;
-				mEvent.deviceType = convertDeviceClass(devClass);
-				mEvent.age = 0;
-				//mEvent.axis = 
-				mEvent.x = mControllerStates[i].rAxis[0].x;
-				mEvent.y = mControllerStates[i].rAxis[0].y;
-				//printf("%s [%d]: (% 1.2f, % 1.2f)\n", toString(mEvent.deviceType), i, mEvent.x, mEvent.y);
-				return true;*/
-			}
+	updateInputs();
+	return false;
+}
+
+size_t VRSystem::pollEvents(Event * out, size_t max, EventMask filter){
+	if(!valid()) return 0;
+
+	size_t num = 0;
+	bool drained = false;
+	while(num < max){
+		if(!ovr().PollNextEvent(&mVREvent, sizeof(mVREvent))){
+			drained = true;
+			break;
 		}
+		translateEvent(mVREvent, out[num]);
+		if(eventCategory(out[num].type) & filter) ++num;
 	}
-	return false;
+	if(num) mEvent = out[num-1];
+
+	// As with pollEvent(), only update inputs once the queue is drained, so
+	// a caller looping over a burst does not clear button changes or step
+	// gestures more than once per frame
+	if(drained) updateInputs();
+	return num;
 }
 
 void VRSystem::hapticPulse(int hand, int axisID, unsigned short microSec){
 	if(!valid()) return;
-	mImpl->TriggerHapticPulse(controllerIndex(hand), axisID - AXIS0, microSec);
+	ovr().TriggerHapticPulse(controllerIndex(hand), axisID - AXIS0, microSec);
+}
+
+struct VRSystem::HapticScheduler{
+	// OpenVR ignores pulses on a controller and axis closer than this
+	static constexpr double MIN_INTERVAL = 0.005;
+
+	// Waveform with the device it plays on, resolved when queued
+	struct QueuedWave{
+		HapticWave wave;
+		unsigned device = vr::k_unTrackedDeviceIndexInvalid;
+	};
+
+	struct Hand{
+		SPSCRing<QueuedWave, HAPTIC_QUEUE_SIZE> queue;
+		std::atomic<unsigned> stops{0};
+	};
+
+	// Waveform being played; only touched by the scheduler thread
+	struct Playing{
+		QueuedWave queued;
+		double start = 0.;		// time of wave start
+		double end = 0.;		// time of wave end; the next wave starts here
+		double next = 0.;		// time of next pulse
+		double last = -1.;		// time of last pulse
+		unsigned stops = 0;
+		bool active = false;
+	};
+
+	vr::IVRSystem * impl;
+	std::atomic<bool> running{true};
+	Hand hands[2];
+	std::thread thread;
+
+	// Blocks the thread while no waveforms are queued or playing
+	std::mutex mutex;
+	std::condition_variable cond;
+	std::atomic<bool> sleeping{false};
+
+	HapticScheduler(vr::IVRSystem * impl_): impl(impl_){}
+
+	// Called by producers after queuing; only locks if the thread is asleep
+	void wake(){
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if(sleeping.load(std::memory_order_relaxed)){
+			std::lock_guard<std::mutex> lock(mutex);
+			sleeping = false;
+			cond.notify_one();
+		}
+	}
+
+	// Advance a hand's playback; returns time of its next pulse or a large value if idle
+	double update(int h, Playing& p, double now){
+		auto& hand = hands[h];
+		const unsigned stops = hand.stops.load(std::memory_order_acquire);
+		if(stops != p.stops){
+			p.stops = stops;
+			p.active = false;
+			p.end = 0.;
+			hand.queue.clear();
+		}
+
+		auto& wave = p.queued.wave;
+		for(;;){
+			if(!p.active){
+				if(!hand.queue.pop(p.queued)) return 1e30;
+				p.active = true;
+				// Play back to back with the previous wave unless it ended already
+				p.start = std::max(now, p.end) + wave.delay;
+				p.end = p.start + wave.duration;
+				p.next = std::max(p.start, p.last + MIN_INTERVAL);
+			}
+
+			const double t = p.next - p.start;
+			if(t >= wave.duration){
+				p.active = false;
+				continue;
+			}
+			if(p.next > now) return p.next;
+
+			const float f = wave.duration > 0.f ? t / wave.duration : 0.f;
+			float a = wave.amplitude0 + (wave.amplitude1 - wave.amplitude0)*f;
+			a = a < 0.f ? 0.f : (a > 1.f ? 1.f : a);
+			const auto us = (unsigned short)(a * wave.maxMicroSec + 0.5f);
+			if(us){
+				impl->TriggerHapticPulse(p.queued.device, wave.axisID - AXIS0, us);
+				p.last = now;
+			}
+			// If we woke late, catch up without breaking the minimum spacing
+			p.next = std::max(p.next + std::max<double>(wave.interval, MIN_INTERVAL), p.last + MIN_INTERVAL);
+		}
+	}
+
+	void run(){
+		using Clock = std::chrono::steady_clock;
+		const double poll = 0.002; // poll period for new waves while playing
+		Playing playing[2];
+
+		while(running.load(std::memory_order_relaxed)){
+			const double now = time();
+			double next = 1e30;
+			for(int h=0; h<2; ++h) next = std::min(next, update(h, playing[h], now));
+
+			if(next >= 1e30){ // idle; sleep until a wave is queued
+				std::unique_lock<std::mutex> lock(mutex);
+				sleeping = true;
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+				if(running.load(std::memory_order_relaxed) && hands[0].queue.empty() && hands[1].queue.empty()){
+					cond.wait(lock, [this](){ return !sleeping.load(); });
+				}
+				sleeping = false;
+				continue;
+			}
+
+			const double wake = std::min(next, now + poll);
+			std::this_thread::sleep_until(Clock::now() + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(wake - now)));
+		}
+	}
+};
+constexpr double VRSystem::HapticScheduler::MIN_INTERVAL;
+
+bool VRSystem::startHaptics(){
+	if(!valid()) return false;
+	stopHaptics();
+	mHaptics = new HapticScheduler(mImpl);
+	mHaptics->thread = std::thread([this](){ mHaptics->run(); });
+	return true;
+}
+
+void VRSystem::stopHaptics(){
+	if(mHaptics){
+		mHaptics->running = false;
+		mHaptics->wake();
+		mHaptics->thread.join();
+		delete mHaptics;
+		mHaptics = nullptr;
+	}
+}
+
+bool VRSystem::hapticWave(int hand, const HapticWave& w){
+	if(!mHaptics || (hand != LEFT && hand != RIGHT) || !numControllers()) return false;
+	// Same device as controller(hand) and hapticPulse()
+	HapticScheduler::QueuedWave q;
+	q.wave = w;
+	q.device = controllerIndex(hand);
+	if(!mHaptics->hands[hand].queue.push(q)) return false;
+	mHaptics->wake();
+	return true;
+}
+
+void VRSystem::hapticStop(int hand){
+	if(!mHaptics || (hand != LEFT && hand != RIGHT)) return;
+	mHaptics->hands[hand].stops.fetch_add(1, std::memory_order_release);
 }
 
 bool VRSystem::FBO::create(int w, int h){
@@ -1138,6 +2776,248 @@ bool VRSystem::FBO::create(int w, int h){
 	return true;
 }
 
+namespace{
+// The header, if any, must begin with the #version directive
+unsigned compileShader(GLenum type, const char * src, const char * header = ""){
+	auto shader = glCreateShader(type);
+	const char * srcs[] = {header, src};
+	glShaderSource(shader, 2, srcs, nullptr);
+	glCompileShader(shader);
+	GLint ok = GL_FALSE;
+	glGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+	if(!ok){
+		char log[1024];
+		glGetShaderInfoLog(shader, sizeof(log), nullptr, log);
+		printf("Shader compile error: %s\n", log);
+	}
+	return shader;
+}
+
+unsigned makeProgram(const char * vert, const char * frag, const char * fragHeader = ""){
+	auto vs = compileShader(GL_VERTEX_SHADER, vert);
+	auto fs = compileShader(GL_FRAGMENT_SHADER, frag, fragHeader);
+	auto prog = glCreateProgram();
+	glAttachShader(prog, vs);
+	glAttachShader(prog, fs);
+	glLinkProgram(prog);
+	glDeleteShader(vs); // deleted with program
+	glDeleteShader(fs);
+	GLint ok = GL_FALSE;
+	glGetProgramiv(prog, GL_LINK_STATUS, &ok);
+	if(!ok){
+		char log[1024];
+		glGetProgramInfoLog(prog, sizeof(log), nullptr, log);
+		printf("Shader link error: %s\n", log);
+		glDeleteProgram(prog);
+		return 0;
+	}
+	return prog;
+}
+}
+
+bool VRSystem::CoreGL::create(){
+	mMeshProg = makeProgram(R"(#version 330 core
+		layout(location=0) in vec2 pos;
+		layout(location=1) in vec4 col;
+		uniform mat4 mvp;
+		out vec4 vCol;
+		void main(){ gl_Position = mvp * vec4(pos, 0., 1.); vCol = col; }
+	)", R"(#version 330 core
+		uniform vec4 color;
+		in vec4 vCol;
+		out vec4 fragColor;
+		void main(){ fragColor = vCol * color; }
+	)");
+	mTexProg = makeProgram(R"(#version 330 core
+		uniform vec4 rect; // l, b, r, t
+		uniform vec4 bounds; // umin, vmin, umax, vmax
+		out vec2 vTex;
+		void main(){
+			vec2 c = vec2(gl_VertexID & 1, gl_VertexID >> 1);
+			gl_Position = vec4(mix(rect.xy, rect.zw, c), 0., 1.);
+			vTex = mix(bounds.xy, bounds.zw, c);
+		}
+	)", R"(#version 330 core
+		uniform sampler2D tex;
+		uniform float bright;
+		in vec2 vTex;
+		out vec4 fragColor;
+		void main(){ fragColor = vec4(texture(tex, vTex).rgb * bright, 1.); }
+	)");
+	if(!mMeshProg || !mTexProg){
+		destroy();
+		return false;
+	}
+	mMeshMVP = glGetUniformLocation(mMeshProg, "mvp");
+	mMeshColor = glGetUniformLocation(mMeshProg, "color");
+	mTexRect = glGetUniformLocation(mTexProg, "rect");
+	mTexBounds = glGetUniformLocation(mTexProg, "bounds");
+	mTexBright = glGetUniformLocation(mTexProg, "bright");
+
+	glGenVertexArrays(2, mMaskVAO);
+	glGenBuffers(2, mMaskVBO);
+	for(int i=0; i<2; ++i){
+		glBindVertexArray(mMaskVAO[i]);
+		glBindBuffer(GL_ARRAY_BUFFER, mMaskVBO[i]);
+		glEnableVertexAttribArray(0);
+		glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, nullptr);
+	}
+
+	glGenVertexArrays(1, &mVigVAO);
+	glGenBuffers(3, mVigVBO);
+	glBindVertexArray(mVigVAO);
+	glBindBuffer(GL_ARRAY_BUFFER, mVigVBO[0]);
+	glEnableVertexAttribArray(0);
+	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, nullptr);
+	glBindBuffer(GL_ARRAY_BUFFER, mVigVBO[1]);
+	glEnableVertexAttribArray(1);
+	glVertexAttribPointer(1, 4, GL_UNSIGNED_BYTE, GL_TRUE, 0, nullptr);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mVigVBO[2]);
+
+	glGenVertexArrays(1, &mQuadVAO); // core profile draws need a VAO bound
+
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	printGLError("CoreGL::create");
+	return true;
+}
+
+void VRSystem::CoreGL::destroy(){
+	if(mMeshProg) glDeleteProgram(mMeshProg);
+	if(mTexProg) glDeleteProgram(mTexProg);
+	mMeshProg = mTexProg = 0; // flags that resources are destroyed
+	if(mMaskVAO[0]){
+		glDeleteVertexArrays(2, mMaskVAO);
+		glDeleteBuffers(2, mMaskVBO);
+		glDeleteVertexArrays(1, &mVigVAO);
+		glDeleteBuffers(3, mVigVBO);
+		glDeleteVertexArrays(1, &mQuadVAO);
+	}
+	*this = CoreGL();
+}
+
+bool VRSystem::FoveaGL::create(){
+	// Pattern of shaded quads shared by mask and fill passes. Each 2x2 quad
+	// is shaded or skipped as a whole since GPUs shade in quads.
+	const char * pattern = R"(#version 330 core
+		uniform vec4 viewport; // x, y, w, h in pixels
+		uniform vec4 lens; // lens center in NDC, inner and outer radius squared
+		bool shaded(ivec2 pix){
+			ivec2 q = pix >> 1;
+			vec2 p = (vec2(2*q + 1) - viewport.xy) / viewport.zw * 2. - 1. - lens.xy;
+			float r2 = dot(p, p);
+			if(r2 < lens.z) return true;
+			if(r2 < lens.w) return ((q.x + q.y) & 1) == 0;
+			return ((q.x | q.y) & 1) == 0;
+		}
+	)";
+	const char * vert = R"(#version 330 core
+		void main(){ gl_Position = vec4(vec2(gl_VertexID & 1, gl_VertexID >> 1) * 4. - 1., -1., 1.); }
+	)";
+	mMaskProg = makeProgram(vert, R"(
+		void main(){ if(shaded(ivec2(gl_FragCoord.xy))) discard; }
+	)", pattern);
+	mFillProg = makeProgram(vert, R"(
+		uniform sampler2D tex;
+		out vec4 fragColor;
+		void main(){
+			ivec2 pix = ivec2(gl_FragCoord.xy);
+			if(shaded(pix)) discard;
+			ivec2 lo = ivec2(viewport.xy), hi = lo + ivec2(viewport.zw) - 1;
+			// Average shaded neighbors, looking further out at the viewport edges
+			vec4 sum = vec4(0.);
+			for(int r=1; r<=2 && sum.w == 0.; ++r){
+			for(int j=-r; j<=r; ++j){
+			for(int i=-r; i<=r; ++i){
+				ivec2 n = pix + ivec2(i, j);
+				if(all(greaterThanEqual(n, lo)) && all(lessThanEqual(n, hi)) && shaded(n))
+					sum += vec4(texelFetch(tex, n, 0).rgb, 1.);
+			}}}
+			if(sum.w == 0.) discard;
+			fragColor = vec4(sum.rgb / sum.w, 1.);
+		}
+	)", pattern);
+	if(!mMaskProg || !mFillProg){
+		destroy();
+		return false;
+	}
+	mMaskViewport = glGetUniformLocation(mMaskProg, "viewport");
+	mMaskLens = glGetUniformLocation(mMaskProg, "lens");
+	mFillViewport = glGetUniformLocation(mFillProg, "viewport");
+	mFillLens = glGetUniformLocation(mFillProg, "lens");
+
+	glGenVertexArrays(1, &mVAO);
+	glGenTextures(1, &mCopyTex);
+	glBindTexture(GL_TEXTURE_2D, mCopyTex);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	glGenFramebuffers(1, &mCopyBuf);
+	printGLError("FoveaGL::create");
+	return true;
+}
+
+void VRSystem::FoveaGL::destroy(){
+	if(mMaskProg) glDeleteProgram(mMaskProg);
+	if(mFillProg) glDeleteProgram(mFillProg);
+	if(mVAO){
+		glDeleteVertexArrays(1, &mVAO);
+		glDeleteTextures(1, &mCopyTex);
+		glDeleteFramebuffers(1, &mCopyBuf);
+	}
+	*this = FoveaGL();
+}
+
+bool VRSystem::StereoFBO::create(int w, int h){
+
+	glGetError(); // clear any existing errors
+
+	auto makeArray = [](unsigned& tex, GLint internalFormat, GLenum format, GLenum type, int w, int h){
+		auto target = GL_TEXTURE_2D_ARRAY;
+		glGenTextures(1, &tex);
+		glBindTexture(target, tex);
+			glTexParameteri(target, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+			glTexParameteri(target, GL_TEXTURE_MAX_LEVEL, 0);
+			glTexImage3D(target, 0, internalFormat, w, h, 2, 0, format, type, nullptr);
+		glBindTexture(target, 0);
+	};
+	makeArray(mColorTex, GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE, w, h);
+	makeArray(mDepthTex, GL_DEPTH_COMPONENT24, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, w, h);
+	printGLError("glTexImage3D on stereo tex");
+
+	bool complete = true;
+	glGenFramebuffers(1, &mLayeredBuf);
+	glBindFramebuffer(GL_FRAMEBUFFER, mLayeredBuf);
+		glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, mColorTex, 0);
+		glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, mDepthTex, 0);
+		complete &= GL_FRAMEBUFFER_COMPLETE == glCheckFramebufferStatus(GL_FRAMEBUFFER);
+
+	for(int i=0; i<2; ++i){
+		glGenFramebuffers(1, &mLayerBuf[i]);
+		glBindFramebuffer(GL_FRAMEBUFFER, mLayerBuf[i]);
+			glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, mColorTex, 0, i);
+			glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, mDepthTex, 0, i);
+			complete &= GL_FRAMEBUFFER_COMPLETE == glCheckFramebufferStatus(GL_FRAMEBUFFER);
+	}
+	printGLError("glCheckFramebufferStatus on stereo frame bufs");
+
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	if(!complete) destroy();
+	return complete;
+}
+
+void VRSystem::StereoFBO::destroy(){
+	if(!mLayeredBuf) return;
+	glDeleteFramebuffers(1, &mLayeredBuf);
+	mLayeredBuf = 0; // flags that FBO is destroyed
+	glDeleteFramebuffers(2, mLayerBuf);
+	mLayerBuf[0] = mLayerBuf[1] = 0;
+	glDeleteTextures(1, &mColorTex);
+	glDeleteTextures(1, &mDepthTex);
+	mColorTex = mDepthTex = 0;
+}
+
 void VRSystem::FBO::destroy(){
 	if(!mDepthBuf) return;
 	glDeleteRenderbuffers(1, &mDepthBuf);
@@ -1178,7 +3058,7 @@ bool VRSystem::startCamera(){
 	}
 	DPRINTF("Camera firmware: %s\n", buffer);//*/
 
-	auto frameLayout = mImpl->GetInt32TrackedDeviceProperty(dev, vr::Prop_CameraFrameLayout_Int32);
+	auto frameLayout = ovr().GetInt32TrackedDeviceProperty(dev, vr::Prop_CameraFrameLayout_Int32);
 	if(vr::EVRTrackedCameraFrameLayout_Mono == frameLayout & 0xF){
 		mFrameType = MONO;
 	} else {
@@ -1188,7 +3068,7 @@ bool VRSystem::startCamera(){
 		}
 	}
 	
-	mNumCameras = mImpl->GetInt32TrackedDeviceProperty(dev, vr::Prop_NumCameras_Int32);
+	mNumCameras = ovr().GetInt32TrackedDeviceProperty(dev, vr::Prop_NumCameras_Int32);
 	//printf("%d\n", frameLayout);
 	//printf("%d\n", numCameras);
 
@@ -1264,20 +3144,107 @@ bool VRSystem::grabCameraFrame(){
 	return true;
 }
 
-template <int BufSize=64>
-std::string devPropString(vr::IVRSystem * impl, int devIndex, vr::ETrackedDeviceProperty prop){
+const VRSystem::PropEntry& VRSystem::property(int device, vr::ETrackedDeviceProperty prop, PropType type) const {
+	static const PropEntry none;
+	if(!valid() || device < 0 || device >= MAX_TRACKED_DEVICES) return none;
+
+	const uint32_t key = (uint32_t(device+1) << 16) | (uint32_t(prop) & 0xffff);
+	unsigned i = (key * 2654435761u) >> 22; // Fibonacci hash to 10 bits
+	static_assert(PROP_CACHE_SIZE == 1<<10, "Update hash to match cache size");
+
+	for(;; i = (i+1) & (PROP_CACHE_SIZE-1)){
+		auto& e = mPropCache[i];
+		if(e.key == key){
+			if(e.type == type) return e;
+			break; // invalidated or accessed as different type
+		}
+		if(0 == e.key){
+			if(mPropCount >= PROP_CACHE_SIZE*3/4){ // keep probes short
+				DPRINTF("Property cache full; clearing\n"); // strings stay interned
+				for(auto& v : mPropCache) v = PropEntry();
+				mPropCount = 0;
+				return property(device, prop, type);
+			}
+			++mPropCount;
+			e.key = key;
+			break;
+		}
+	}
+
+	auto& e = mPropCache[i];
 	auto err = vr::TrackedProp_Success;
-	char str[BufSize];
-	impl->GetStringTrackedDeviceProperty(devIndex, prop, str, sizeof(str), &err);
-	return vr::TrackedProp_Success == err ? str : "";
+	e.type = type;
+	switch(type){
+	case PROP_FLOAT:	e.f = ovr().GetFloatTrackedDeviceProperty(device, prop, &err); break;
+	case PROP_INT:		e.i = ovr().GetInt32TrackedDeviceProperty(device, prop, &err); break;
+	case PROP_UINT64:	e.u = ovr().GetUint64TrackedDeviceProperty(device, prop, &err); break;
+	case PROP_BOOL:		e.b = ovr().GetBoolTrackedDeviceProperty(device, prop, &err); break;
+	case PROP_STRING:{
+		char buf[128];
+		auto len = ovr().GetStringTrackedDeviceProperty(device, prop, buf, sizeof(buf), &err);
+		if(vr::TrackedProp_Success == err){
+			if(strcmp(e.str, buf)) e.str = mPropStrings.emplace(buf).first->c_str();
+		} else if(vr::TrackedProp_BufferTooSmall == err){
+			std::string str(len, '\0');
+			ovr().GetStringTrackedDeviceProperty(device, prop, &str[0], len, &err);
+			str.resize(len ? len-1 : 0); // remove null terminator
+			if(vr::TrackedProp_Success == err) e.str = mPropStrings.insert(std::move(str)).first->c_str();
+		}
+	} break;
+	default:;
+	}
+	e.ok = vr::TrackedProp_Success == err;
+	return e;
+}
+
+void VRSystem::invalidateProperty(int device, vr::ETrackedDeviceProperty prop){
+	const uint32_t key = (uint32_t(device+1) << 16) | (uint32_t(prop) & 0xffff);
+	for(auto& e : mPropCache){
+		if(e.key == key){ e.type = PROP_NONE; return; }
+	}
+}
+
+void VRSystem::invalidateProperties(int device){
+	for(auto& e : mPropCache){
+		if((e.key >> 16) == uint32_t(device+1)) e.type = PROP_NONE;
+	}
+}
+
+float VRSystem::propertyFloat(int device, vr::ETrackedDeviceProperty prop, float def) const {
+	const auto& e = property(device, prop, PROP_FLOAT);
+	return e.ok ? e.f : def;
+}
+
+int32_t VRSystem::propertyInt(int device, vr::ETrackedDeviceProperty prop, int32_t def) const {
+	const auto& e = property(device, prop, PROP_INT);
+	return e.ok ? e.i : def;
+}
+
+uint64_t VRSystem::propertyUint64(int device, vr::ETrackedDeviceProperty prop, uint64_t def) const {
+	const auto& e = property(device, prop, PROP_UINT64);
+	return e.ok ? e.u : def;
+}
+
+bool VRSystem::propertyBool(int device, vr::ETrackedDeviceProperty prop, bool def) const {
+	const auto& e = property(device, prop, PROP_BOOL);
+	return e.ok ? e.b : def;
+}
+
+const char * VRSystem::propertyString(int device, vr::ETrackedDeviceProperty prop, const char * def) const {
+	const auto& e = property(device, prop, PROP_STRING);
+	return e.ok ? e.str : def;
+}
+
+const char * VRSystem::propertyString(const TrackedDevice& dev, vr::ETrackedDeviceProperty prop, const char * def) const {
+	return propertyString(dev.implIndex, prop, def);
 }
 
 std::string VRSystem::manufacturer(const TrackedDevice& dev) const {
-	return devPropString(mImpl, dev.implIndex, vr::Prop_ManufacturerName_String);
+	return propertyString(dev, vr::Prop_ManufacturerName_String);
 }
 
 std::string VRSystem::model(const TrackedDevice& dev) const {
-	return devPropString(mImpl, dev.implIndex, vr::Prop_ModelNumber_String);
+	return propertyString(dev, vr::Prop_ModelNumber_String);
 }
 
 void VRSystem::print() const {
@@ -1303,6 +3270,23 @@ Matrix4 toMatrix4(const vr::HmdMatrix44_t& mat){
 	}};
 }
 
+RigidPose toRigidPose(const vr::HmdMatrix34_t& mat){
+	RigidPose p;
+	rotationToQuat(p.quat, [&mat](int r, int c){ return mat.m[r][c]; });
+	for(int i=0; i<3; ++i) p.pos[i] = mat.m[i][3];
+	p.normalize();
+	return p;
+}
+
+vr::HmdMatrix34_t toHmdMatrix34(const RigidPose& p){
+	const auto m = p.toMatrix4();
+	vr::HmdMatrix34_t mat;
+	for(int r=0; r<3; ++r){
+		for(int c=0; c<4; ++c) mat.m[r][c] = m[c*4+r];
+	}
+	return mat;
+}
+
 const char * toString(vr::EVREventType v){
 	return vr::VRSystem()->GetEventTypeNameFromEnum(v);
 }
@@ -1314,6 +3298,7 @@ const char * toString(VRSystem::EventType v){
 		CS(INTERACTION_STARTED) CS(INTERACTION_ENDED)
 		CS(STANDBY_STARTED) CS(STANDBY_ENDED)
 		CS(BUTTON_DOWN) CS(BUTTON_UP) CS(TOUCH) CS(UNTOUCH)
+		CS(AXIS_CHANGED)
 		default: return toString(vr::EVREventType(v));
 	}
 }
@@ -1326,4 +3311,20 @@ const char * toString(VRSystem::DeviceType v){
 		default: return "";
 	}
 }
+
+const char * toString(VRSystem::GpuStage v){
+	switch(v){
+		CS(GPU_FRAME) CS(GPU_CLEAR) CS(GPU_MASK) CS(GPU_FOVEATION)
+		CS(GPU_DRAW_LEFT) CS(GPU_DRAW_RIGHT) CS(GPU_VIGNETTE) CS(GPU_RESOLVE) CS(GPU_SUBMIT)
+		default: return "";
+	}
+}
+
+const char * toString(VRSystem::FrameMetric v){
+	switch(v){
+		CS(FRAME_CLIENT_CPU) CS(FRAME_CLIENT_GPU) CS(FRAME_COMPOSITOR_CPU)
+		CS(FRAME_COMPOSITOR_GPU) CS(FRAME_WAIT_POSES) CS(FRAME_INTERVAL)
+		default: return "";
+	}
+}
 #undef CS
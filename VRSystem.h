@@ -6,8 +6,13 @@ Lance Putnam, 2016
 #ifndef VRSYSTEM_HPP_INC
 #define VRSYSTEM_HPP_INC
 
+#include <atomic>
+#include <cmath> // sqrt
+#include <cstdint> // uint64_t
 #include <functional>
+#include <string>
 #include <type_traits> // is_same
+#include <unordered_set>
 #include <vector>
 #if defined(__MSYS__) || defined(__MINGW32__)
 	// MinGW/MinGW-w64 compatible header courtesy of:
@@ -18,6 +23,23 @@ Lance Putnam, 2016
 	#include <openvr.h>
 #endif
 
+// SIMD code path for matrix math, chosen at compile time.
+// Define VRSYSTEM_NO_SIMD to force the scalar code path.
+#ifndef VRSYSTEM_NO_SIMD
+	#if defined(__SSE__) || defined(_M_X64) || defined(_M_AMD64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+		#define VRSYSTEM_SSE
+		#include <immintrin.h>
+		#ifdef __FMA__
+			#define VRSYSTEM_MADD(a,b,c) _mm_fmadd_ps(a,b,c)
+		#else
+			#define VRSYSTEM_MADD(a,b,c) _mm_add_ps(_mm_mul_ps(a,b),c)
+		#endif
+	#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+		#define VRSYSTEM_NEON
+		#include <arm_neon.h>
+	#endif
+#endif
+
 
 /// VR headset and controller I/O
 class VRSystem{
@@ -63,9 +85,40 @@ public:
 		BUTTON_DOWN				= vr::VREvent_ButtonPress,
 		BUTTON_UP				= vr::VREvent_ButtonUnpress,
 		TOUCH					= vr::VREvent_ButtonTouch,
-		UNTOUCH					= vr::VREvent_ButtonUntouch
+		UNTOUCH					= vr::VREvent_ButtonUntouch,
+
+		/// Controller axis moved; only generated by the input pump
+		AXIS_CHANGED			= vr::VREvent_VendorSpecific_Reserved_End + 1
 	};
 
+	/// Event categories used to filter events
+
+	/// These are bit flags that can be or'ed together.
+	enum EventCategory{
+		DEVICE_EVENTS			= 1<<0, ///< ACTIVATED, DEACTIVATED, ROLE_CHANGED
+		INTERACTION_EVENTS		= 1<<1, ///< INTERACTION_STARTED, INTERACTION_ENDED
+		STANDBY_EVENTS			= 1<<2, ///< STANDBY_STARTED, STANDBY_ENDED
+		BUTTON_EVENTS			= 1<<3, ///< BUTTON_DOWN, BUTTON_UP
+		TOUCH_EVENTS			= 1<<4, ///< TOUCH, UNTOUCH
+		OTHER_EVENTS			= 1<<5, ///< OpenVR events not in EventType
+		AXIS_EVENTS				= 1<<6, ///< AXIS_CHANGED
+		ALL_EVENTS				= (1<<7)-1
+	};
+	typedef unsigned EventMask;
+
+	/// Get category of an event type
+	static EventCategory eventCategory(EventType t){
+		switch(t){
+		case ACTIVATED: case DEACTIVATED: case ROLE_CHANGED: return DEVICE_EVENTS;
+		case INTERACTION_STARTED: case INTERACTION_ENDED: return INTERACTION_EVENTS;
+		case STANDBY_STARTED: case STANDBY_ENDED: return STANDBY_EVENTS;
+		case BUTTON_DOWN: case BUTTON_UP: return BUTTON_EVENTS;
+		case TOUCH: case UNTOUCH: return TOUCH_EVENTS;
+		case AXIS_CHANGED: return AXIS_EVENTS;
+		default: return OTHER_EVENTS;
+		}
+	}
+
 	enum Button{
 		SYSTEM = 0,
 		MENU = 1,
@@ -78,6 +131,22 @@ public:
 		TRIGGER = AXIS1
 	};
 
+	/// Button gestures recognised from presses and releases
+	enum Gesture{
+		SINGLE_CLICK,	///< Press and release, then no press within click interval
+		DOUBLE_CLICK,	///< Two clicks, each press within click interval of last release
+		TRIPLE_CLICK,	///< Three clicks; reported on the third release
+		LONG_PRESS,		///< Button held down for long press time; reported while down
+		HOLD_RELEASE,	///< Button released after a long press
+		NUM_GESTURES
+	};
+
+	/// Timing of button gestures, in seconds
+	struct GestureTiming{
+		float clickInterval = 0.25f;	///< Max time from release to next press of a multi-click
+		float longPress = 0.5f;			///< Min time held for a long press
+	};
+
 	enum Shape{
 		ELLIPSE,
 		RECT
@@ -187,16 +256,15 @@ public:
 		}
 
 		Matrix4 operator* (const Matrix4& n) const {
-			return Matrix4{{
-				m[0]*n[ 0] + m[4]*n[ 1] + m[8]*n[ 2] + m[12]*n[ 3], m[1]*n[ 0] + m[5]*n[ 1] + m[9]*n[ 2] + m[13]*n[ 3], m[2]*n[ 0] + m[6]*n[ 1] + m[10]*n[ 2] + m[14]*n[ 3], m[3]*n[ 0] + m[7]*n[ 1] + m[11]*n[ 2] + m[15]*n[ 3],
-				m[0]*n[ 4] + m[4]*n[ 5] + m[8]*n[ 6] + m[12]*n[ 7], m[1]*n[ 4] + m[5]*n[ 5] + m[9]*n[ 6] + m[13]*n[ 7], m[2]*n[ 4] + m[6]*n[ 5] + m[10]*n[ 6] + m[14]*n[ 7], m[3]*n[ 4] + m[7]*n[ 5] + m[11]*n[ 6] + m[15]*n[ 7],
-				m[0]*n[ 8] + m[4]*n[ 9] + m[8]*n[10] + m[12]*n[11], m[1]*n[ 8] + m[5]*n[ 9] + m[9]*n[10] + m[13]*n[11], m[2]*n[ 8] + m[6]*n[ 9] + m[10]*n[10] + m[14]*n[11], m[3]*n[ 8] + m[7]*n[ 9] + m[11]*n[10] + m[15]*n[11],
-				m[0]*n[12] + m[4]*n[13] + m[8]*n[14] + m[12]*n[15], m[1]*n[12] + m[5]*n[13] + m[9]*n[14] + m[13]*n[15], m[2]*n[12] + m[6]*n[13] + m[10]*n[14] + m[14]*n[15], m[3]*n[12] + m[7]*n[13] + m[11]*n[14] + m[15]*n[15]
-			}};
+			Matrix4 r;
+			multiply(r, *this, n);
+			return r;
 		}
 
 		Vec4 operator* (const Vec4& v) const {
-			return Vec4(row<0>().dot(v), row<1>().dot(v), row<2>().dot(v), row<3>().dot(v));
+			Vec4 r;
+			transform(r.data(), m, v.data());
+			return r;
 		}
 
 		Matrix4& transpose(){
@@ -207,32 +275,237 @@ public:
 		}
 
 		Matrix4& invertRigid(){
-			// Given A = T * R, A^-1 = R^-1 * T^-1
-			// R^-1 = R^T; transpose rotation part to invert it
-			std::swap(m[1],m[4]);
-			std::swap(m[2],m[8]);
-			std::swap(m[6],m[9]);
-
-			// compute R^-1 * T^-1
-			auto itx = m[ 0]*-m[12] + m[ 4]*-m[13] + m[ 8]*-m[14];
-			auto ity = m[ 1]*-m[12] + m[ 5]*-m[13] + m[ 9]*-m[14];
-			auto itz = m[ 2]*-m[12] + m[ 6]*-m[13] + m[10]*-m[14];
-
-			m[12]=itx;
-			m[13]=ity;
-			m[14]=itz;
+			inverseRigid(m, m);
 			return *this;
 		}
 
 		Matrix4 inverseRigid() const {
-			return Matrix4(*this).invertRigid();
+			Matrix4 r;
+			inverseRigid(r.m, m);
+			return r;
 		}
 
 		Matrix4& invertOrthogonal(){
+			inverseOrthogonal(m, m);
+			return *this;
+		}
+
+		/// Multiply matrices, dst = a * b
+
+		/// The destination may alias either operand.
+		///
+		static void multiply(Matrix4& dst, const Matrix4& a, const Matrix4& b){
+			#if defined(VRSYSTEM_SSE) && defined(__AVX__)
+				const auto a0 = _mm256_broadcast_ps((const __m128 *)(a.m   ));
+				const auto a1 = _mm256_broadcast_ps((const __m128 *)(a.m+ 4));
+				const auto a2 = _mm256_broadcast_ps((const __m128 *)(a.m+ 8));
+				const auto a3 = _mm256_broadcast_ps((const __m128 *)(a.m+12));
+				for(int j=0; j<16; j+=8) _mm256_storeu_ps(dst.m+j, mulCols(a0,a1,a2,a3, b.m+j));
+			#elif defined(VRSYSTEM_SSE) || defined(VRSYSTEM_NEON)
+				// Load all of b before storing so loads are not ordered
+				// behind stores to a possibly aliased dst
+				const auto a0 = load(a.m), a1 = load(a.m+4), a2 = load(a.m+8), a3 = load(a.m+12);
+				const auto b0 = load(b.m), b1 = load(b.m+4), b2 = load(b.m+8), b3 = load(b.m+12);
+				store(dst.m   , mulCol(a0,a1,a2,a3, b0));
+				store(dst.m+ 4, mulCol(a0,a1,a2,a3, b1));
+				store(dst.m+ 8, mulCol(a0,a1,a2,a3, b2));
+				store(dst.m+12, mulCol(a0,a1,a2,a3, b3));
+			#else
+				float r[16];
+				for(int j=0; j<16; j+=4) transform(r+j, a.m, b.m+j);
+				dst.set(r);
+			#endif
+		}
+
+		/// Multiply arrays of matrices, dst[i] = a[i] * b[i]
+		static void multiply(Matrix4 * dst, const Matrix4 * a, const Matrix4 * b, unsigned n){
+			for(unsigned i=0; i<n; ++i) multiply(dst[i], a[i], b[i]);
+		}
+
+		/// Multiply array of matrices by a common matrix, dst[i] = a * b[i]
+
+		/// This is the typical case of applying a parent transform to a set of
+		/// poses; a is held in registers across the whole array.
+		static void multiply(Matrix4 * dst, const Matrix4& a, const Matrix4 * b, unsigned n){
+			#if defined(VRSYSTEM_SSE) && defined(__AVX__)
+				const auto a0 = _mm256_broadcast_ps((const __m128 *)(a.m   ));
+				const auto a1 = _mm256_broadcast_ps((const __m128 *)(a.m+ 4));
+				const auto a2 = _mm256_broadcast_ps((const __m128 *)(a.m+ 8));
+				const auto a3 = _mm256_broadcast_ps((const __m128 *)(a.m+12));
+				for(unsigned i=0; i<n; ++i){
+					for(int j=0; j<16; j+=8) _mm256_storeu_ps(dst[i].m+j, mulCols(a0,a1,a2,a3, b[i].m+j));
+				}
+			#elif defined(VRSYSTEM_SSE) || defined(VRSYSTEM_NEON)
+				const auto a0 = load(a.m), a1 = load(a.m+4), a2 = load(a.m+8), a3 = load(a.m+12);
+				for(unsigned i=0; i<n; ++i){
+					const auto b0 = load(b[i].m), b1 = load(b[i].m+4), b2 = load(b[i].m+8), b3 = load(b[i].m+12);
+					store(dst[i].m   , mulCol(a0,a1,a2,a3, b0));
+					store(dst[i].m+ 4, mulCol(a0,a1,a2,a3, b1));
+					store(dst[i].m+ 8, mulCol(a0,a1,a2,a3, b2));
+					store(dst[i].m+12, mulCol(a0,a1,a2,a3, b3));
+				}
+			#else
+				const Matrix4 A = a; // in case dst aliases a
+				for(unsigned i=0; i<n; ++i) multiply(dst[i], A, b[i]);
+			#endif
+		}
+
+		/// Known structure of a matrix, used to skip known terms in products
+		enum Form{
+			GENERAL,		///< No known structure
+			AFFINE,			///< Last row is 0,0,0,1 (includes rigid transforms)
+			PERSPECTIVE		///< Projection with nonzeros only at 0,5,8,9,10,11,14
+		};
+
+		/// Multiply matrices of known form, dst = a * b
+
+		/// The destination may alias either operand.
+		///
+		template <int FormA, int FormB>
+		static void multiply(Matrix4& dst, const Matrix4& a, const Matrix4& b){
+			// Note: the scalar path always uses the general kernel since
+			// compilers vectorize it better than the sparse forms
+			#if defined(VRSYSTEM_SSE) || defined(VRSYSTEM_NEON)
+			if(PERSPECTIVE == FormA){
+				// a * c = (a0 c0, a5 c1, 0, 0) + a.col2 c2 + (0, 0, a14, 0) c3
+				#if defined(VRSYSTEM_SSE) && defined(__AVX__)
+					const auto a01 = _mm256_setr_ps(a.m[0], a.m[5], 0.f, 0.f, a.m[0], a.m[5], 0.f, 0.f);
+					const auto a2 = _mm256_broadcast_ps((const __m128 *)(a.m+8));
+					const auto a3 = _mm256_setr_ps(0.f, 0.f, a.m[14], 0.f, 0.f, 0.f, a.m[14], 0.f);
+					for(int j=0; j<16; j+=8) _mm256_storeu_ps(dst.m+j, mulColsPerspective(a01,a2,a3, b.m+j));
+				#else
+					const auto a01 = set(a.m[0], a.m[5], 0.f, 0.f);
+					const auto a2 = load(a.m+8);
+					const auto a3 = set(0.f, 0.f, a.m[14], 0.f);
+					for(int j=0; j<16; j+=4) store(dst.m+j, mulColPerspective(a01,a2,a3, b.m+j));
+				#endif
+				return;
+			}
+			#if !defined(__AVX__) // two-column general kernel is already faster
+			if(AFFINE == FormA && AFFINE == FormB){
+				const auto a0 = load(a.m), a1 = load(a.m+4), a2 = load(a.m+8), a3 = load(a.m+12);
+				const auto b0 = load(b.m), b1 = load(b.m+4), b2 = load(b.m+8), b3 = load(b.m+12);
+				store(dst.m   , mulCol3(a0,a1,a2, b0));
+				store(dst.m+ 4, mulCol3(a0,a1,a2, b1));
+				store(dst.m+ 8, mulCol3(a0,a1,a2, b2));
+				store(dst.m+12, mulCol(a0,a1,a2,a3, b3));
+				return;
+			}
+			#endif
+			#endif
+			multiply(dst, a, b);
+		}
+
+		/// Evaluate product of matrices of known form
+
+		/// Products are grouped from the right so that trailing affine factors
+		/// are combined with the cheaper affine kernel, e.g.
+		///		Matrix4::chain<PERSPECTIVE,AFFINE,AFFINE>(proj, eyeToHead, viewHMD)
+		template <int... Forms, class... Mats>
+		static Matrix4 chain(const Mats&... ms){
+			static_assert(sizeof...(Forms) == sizeof...(Mats), "Number of forms and matrices must match");
+			return ChainEval<Forms...>::eval(ms...);
+		}
+
+		/// Transform point assuming affine matrix, dst = m * (v,1)
+		static void transformAffine(float * dst, const float * m, const float * v){
+			for(int i=0; i<3; ++i) dst[i] = m[i]*v[0] + m[4+i]*v[1] + m[8+i]*v[2] + m[12+i];
+		}
+
+		/// Invert array of rigid transforms (dst may alias src)
+		static void inverseRigid(Matrix4 * dst, const Matrix4 * src, unsigned n){
+			for(unsigned i=0; i<n; ++i) inverseRigid(dst[i].m, src[i].m);
+		}
+
+		/// Invert array of orthogonal transforms (dst may alias src)
+		static void inverseOrthogonal(Matrix4 * dst, const Matrix4 * src, unsigned n){
+			for(unsigned i=0; i<n; ++i) inverseOrthogonal(dst[i].m, src[i].m);
+		}
+
+		/// Transform column vector, dst = m * v (dst may not alias v)
+		static void transform(float * dst, const float * m, const float * v){
+			#if defined(VRSYSTEM_SSE) || defined(VRSYSTEM_NEON)
+				store(dst, mulCol(load(m), load(m+4), load(m+8), load(m+12), v));
+			#else
+				dst[0] = m[0]*v[0] + m[4]*v[1] + m[ 8]*v[2] + m[12]*v[3];
+				dst[1] = m[1]*v[0] + m[5]*v[1] + m[ 9]*v[2] + m[13]*v[3];
+				dst[2] = m[2]*v[0] + m[6]*v[1] + m[10]*v[2] + m[14]*v[3];
+				dst[3] = m[3]*v[0] + m[7]*v[1] + m[11]*v[2] + m[15]*v[3];
+			#endif
+		}
+
+		/// Transform row vector, dst = v * m (dst may not alias v)
+		static void transformRow(float * dst, const float * v, const float * m){
+			#if defined(VRSYSTEM_SSE)
+				const auto vv = load(v);
+				auto p0 = _mm_mul_ps(load(m   ), vv);
+				auto p1 = _mm_mul_ps(load(m+ 4), vv);
+				auto p2 = _mm_mul_ps(load(m+ 8), vv);
+				auto p3 = _mm_mul_ps(load(m+12), vv);
+				_MM_TRANSPOSE4_PS(p0, p1, p2, p3);
+				store(dst, _mm_add_ps(_mm_add_ps(p0,p1), _mm_add_ps(p2,p3)));
+			#elif defined(VRSYSTEM_NEON)
+				const auto vv = load(v);
+				auto p0 = vmulq_f32(load(m   ), vv);
+				auto p1 = vmulq_f32(load(m+ 4), vv);
+				auto p2 = vmulq_f32(load(m+ 8), vv);
+				auto p3 = vmulq_f32(load(m+12), vv);
+				transpose(p0, p1, p2, p3);
+				store(dst, vaddq_f32(vaddq_f32(p0,p1), vaddq_f32(p2,p3)));
+			#else
+				for(int j=0; j<4; ++j){
+					const float * c = m + 4*j;
+					dst[j] = v[0]*c[0] + v[1]*c[1] + v[2]*c[2] + v[3]*c[3];
+				}
+			#endif
+		}
+
+		/// Invert rigid transform stored in src into dst (dst may alias src)
+		static void inverseRigid(float * dst, const float * src){
+			// Given A = T * R, A^-1 = R^-1 * T^-1
+			// R^-1 = R^T; transpose rotation part to invert it
+			#if defined(VRSYSTEM_SSE) || defined(VRSYSTEM_NEON)
+				auto r0 = load(src), r1 = load(src+4), r2 = load(src+8), r3 = zero();
+				const auto t = load(src+12);
+				transpose(r0, r1, r2, r3); // r3 is now garbage, w of r0-r2 is 0
+				// compute R^-1 * T^-1 and set w=1
+				#if defined(VRSYSTEM_SSE)
+					auto it = _mm_mul_ps(r0, _mm_shuffle_ps(t,t,0x00));
+					it = VRSYSTEM_MADD(r1, _mm_shuffle_ps(t,t,0x55), it);
+					it = VRSYSTEM_MADD(r2, _mm_shuffle_ps(t,t,0xAA), it);
+					it = _mm_sub_ps(_mm_setr_ps(0,0,0,1), it);
+				#else
+					auto it = vmulq_lane_f32(r0, vget_low_f32(t), 0);
+					it = vmlaq_lane_f32(it, r1, vget_low_f32(t), 1);
+					it = vmlaq_lane_f32(it, r2, vget_high_f32(t), 0);
+					static const float w1[] = {0,0,0,1};
+					it = vsubq_f32(vld1q_f32(w1), it);
+				#endif
+				store(dst   , r0);
+				store(dst+ 4, r1);
+				store(dst+ 8, r2);
+				store(dst+12, it);
+			#else
+				// src rotation columns are (a,b,c), (d,e,f), (g,h,i)
+				const float a=src[0], b=src[1], c=src[ 2];
+				const float d=src[4], e=src[5], f=src[ 6];
+				const float g=src[8], h=src[9], i=src[10];
+				const float tx=src[12], ty=src[13], tz=src[14];
+				dst[0]=a; dst[4]=b; dst[ 8]=c; dst[12]=-(a*tx + b*ty + c*tz);
+				dst[1]=d; dst[5]=e; dst[ 9]=f; dst[13]=-(d*tx + e*ty + f*tz);
+				dst[2]=g; dst[6]=h; dst[10]=i; dst[14]=-(g*tx + h*ty + i*tz);
+				dst[3]=0; dst[7]=0; dst[11]=0; dst[15]=1;
+			#endif
+		}
+
+		/// Invert orthogonal transform stored in src into dst (dst may alias src)
+		static void inverseOrthogonal(float * dst, const float * src){
 			// Given A = T * R * S, A^-1 = S^-1 * R^-1 * T^-1
-			auto is = 1./(m[0]*m[0] + m[1]*m[1] + m[2]*m[2]);
-			for(int i:{0,1,2, 4,5,6, 8,9,10}) m[i] *= is;
-			return invertRigid();
+			const float is = 1.f/(src[0]*src[0] + src[1]*src[1] + src[2]*src[2]);
+			float r[16];
+			for(int i=0; i<12; ++i) r[i] = src[i]*is;
+			for(int i=12; i<16; ++i) r[i] = src[i];
+			inverseRigid(dst, r);
 		}
 
 		/// Translate in world space by tx*ux + ty*uy + tz*uz
@@ -260,21 +533,272 @@ public:
 		template <class Vec3>
 		Matrix4& shift(const Vec3& t){ return shift(t[0],t[1],t[2]); }
 
+		/// Transform an array of points, dst[i] = this * (src[i], 1)
+
+		/// Points are xyz triplets spaced by the given strides (in floats), so
+		/// interleaved vertex data can be transformed in place. Only the affine
+		/// part of the matrix is applied. Large arrays are split across worker
+		/// threads. dst may equal src if the strides match.
+		void transformPoints(float * dst, const float * src, size_t count, unsigned dstStride=3, unsigned srcStride=3) const;
+		void transformPoints(float * pts, size_t count, unsigned stride=3) const { transformPoints(pts,pts,count,stride,stride); }
+
+		/// Transform an array of directions, dst[i] = this * (src[i], 0)
+
+		/// \see transformPoints for the array layout.
+		///
+		void transformDirs(float * dst, const float * src, size_t count, unsigned dstStride=3, unsigned srcStride=3) const;
+		void transformDirs(float * dirs, size_t count, unsigned stride=3) const { transformDirs(dirs,dirs,count,stride,stride); }
+
 		void print() const;
+
+	private:
+		#if defined(VRSYSTEM_SSE)
+		typedef __m128 Reg;
+		static Reg load(const float * src){ return _mm_loadu_ps(src); }
+		static void store(float * dst, Reg v){ _mm_storeu_ps(dst, v); }
+		static Reg zero(){ return _mm_setzero_ps(); }
+		static Reg set(float a, float b, float c, float d){ return _mm_setr_ps(a,b,c,d); }
+		static void transpose(Reg& c0, Reg& c1, Reg& c2, Reg& c3){ _MM_TRANSPOSE4_PS(c0,c1,c2,c3); }
+		// a * b, where a0-a3 are the columns of a and b is a column vector
+		static Reg mulCol(Reg a0, Reg a1, Reg a2, Reg a3, Reg b){
+			auto r = _mm_mul_ps(a0, _mm_shuffle_ps(b,b,0x00));
+			r = VRSYSTEM_MADD(a1, _mm_shuffle_ps(b,b,0x55), r);
+			r = VRSYSTEM_MADD(a2, _mm_shuffle_ps(b,b,0xAA), r);
+			return VRSYSTEM_MADD(a3, _mm_shuffle_ps(b,b,0xFF), r);
+		}
+		// Broadcast elements of b from memory. A vector load of b would stall
+		// on store forwarding when b was just written element-wise, as with
+		// m * Vec4(x,y,z,1).
+		static Reg mulCol(Reg a0, Reg a1, Reg a2, Reg a3, const float * b){
+			auto r = _mm_mul_ps(a0, _mm_set1_ps(b[0]));
+			r = VRSYSTEM_MADD(a1, _mm_set1_ps(b[1]), r);
+			r = VRSYSTEM_MADD(a2, _mm_set1_ps(b[2]), r);
+			return VRSYSTEM_MADD(a3, _mm_set1_ps(b[3]), r);
+		}
+		#ifdef __AVX__
+		// Two columns at once; a0-a3 hold a column of a in both lanes
+		static __m256 mulCols(__m256 a0, __m256 a1, __m256 a2, __m256 a3, const float * b){
+			const auto bb = _mm256_loadu_ps(b);
+			auto r = _mm256_mul_ps(a0, _mm256_shuffle_ps(bb,bb,0x00));
+			#ifdef __FMA__
+			r = _mm256_fmadd_ps(a1, _mm256_shuffle_ps(bb,bb,0x55), r);
+			r = _mm256_fmadd_ps(a2, _mm256_shuffle_ps(bb,bb,0xAA), r);
+			return _mm256_fmadd_ps(a3, _mm256_shuffle_ps(bb,bb,0xFF), r);
+			#else
+			r = _mm256_add_ps(r, _mm256_mul_ps(a1, _mm256_shuffle_ps(bb,bb,0x55)));
+			r = _mm256_add_ps(r, _mm256_mul_ps(a2, _mm256_shuffle_ps(bb,bb,0xAA)));
+			return _mm256_add_ps(r, _mm256_mul_ps(a3, _mm256_shuffle_ps(bb,bb,0xFF)));
+			#endif
+		}
+		static __m256 mulColsPerspective(__m256 a01, __m256 a2, __m256 a3, const float * b){
+			const auto bb = _mm256_loadu_ps(b);
+			auto r = _mm256_mul_ps(a01, bb);
+			r = _mm256_add_ps(r, _mm256_mul_ps(a2, _mm256_shuffle_ps(bb,bb,0xAA)));
+			return _mm256_add_ps(r, _mm256_mul_ps(a3, _mm256_shuffle_ps(bb,bb,0xFF)));
+		}
+		#endif
+
+		static Reg mulCol3(Reg a0, Reg a1, Reg a2, Reg b){
+			auto r = _mm_mul_ps(a0, _mm_shuffle_ps(b,b,0x00));
+			r = VRSYSTEM_MADD(a1, _mm_shuffle_ps(b,b,0x55), r);
+			return VRSYSTEM_MADD(a2, _mm_shuffle_ps(b,b,0xAA), r);
+		}
+		static Reg mulColPerspective(Reg a01, Reg a2, Reg a3, const float * b){
+			const auto bb = load(b);
+			auto r = _mm_mul_ps(a01, bb);
+			r = VRSYSTEM_MADD(a2, _mm_shuffle_ps(bb,bb,0xAA), r);
+			return VRSYSTEM_MADD(a3, _mm_shuffle_ps(bb,bb,0xFF), r);
+		}
+
+		#elif defined(VRSYSTEM_NEON)
+		typedef float32x4_t Reg;
+		static Reg load(const float * src){ return vld1q_f32(src); }
+		static void store(float * dst, Reg v){ vst1q_f32(dst, v); }
+		static Reg zero(){ return vdupq_n_f32(0.f); }
+		static Reg set(float a, float b, float c, float d){
+			return vcombine_f32(vset_lane_f32(b, vdup_n_f32(a), 1), vset_lane_f32(d, vdup_n_f32(c), 1));
+		}
+		static void transpose(Reg& c0, Reg& c1, Reg& c2, Reg& c3){
+			const auto t01 = vtrnq_f32(c0, c1);
+			const auto t23 = vtrnq_f32(c2, c3);
+			c0 = vcombine_f32(vget_low_f32 (t01.val[0]), vget_low_f32 (t23.val[0]));
+			c1 = vcombine_f32(vget_low_f32 (t01.val[1]), vget_low_f32 (t23.val[1]));
+			c2 = vcombine_f32(vget_high_f32(t01.val[0]), vget_high_f32(t23.val[0]));
+			c3 = vcombine_f32(vget_high_f32(t01.val[1]), vget_high_f32(t23.val[1]));
+		}
+		static Reg mulCol(Reg a0, Reg a1, Reg a2, Reg a3, Reg b){
+			auto r = vmulq_lane_f32(a0, vget_low_f32(b), 0);
+			r = vmlaq_lane_f32(r, a1, vget_low_f32 (b), 1);
+			r = vmlaq_lane_f32(r, a2, vget_high_f32(b), 0);
+			return vmlaq_lane_f32(r, a3, vget_high_f32(b), 1);
+		}
+		static Reg mulCol(Reg a0, Reg a1, Reg a2, Reg a3, const float * b){ return mulCol(a0,a1,a2,a3, load(b)); }
+		static Reg mulCol3(Reg a0, Reg a1, Reg a2, Reg b){
+			auto r = vmulq_lane_f32(a0, vget_low_f32(b), 0);
+			r = vmlaq_lane_f32(r, a1, vget_low_f32 (b), 1);
+			return vmlaq_lane_f32(r, a2, vget_high_f32(b), 0);
+		}
+		static Reg mulColPerspective(Reg a01, Reg a2, Reg a3, const float * b){
+			auto r = vmulq_f32(a01, vld1q_f32(b));
+			r = vmlaq_n_f32(r, a2, b[2]);
+			return vmlaq_n_f32(r, a3, b[3]);
+		}
+		#endif
+
+		template <int... Forms> struct ChainEval;
+		template <int F0, int F1> struct ChainEval<F0,F1>{
+			enum{ form = (AFFINE==F0 && AFFINE==F1) ? AFFINE : GENERAL };
+			static Matrix4 eval(const Matrix4& m0, const Matrix4& m1){
+				Matrix4 r;
+				multiply<F0,F1>(r, m0, m1);
+				return r;
+			}
+		};
+		template <int F0, int F1, int F2, int... Fs> struct ChainEval<F0,F1,F2,Fs...>{
+			typedef ChainEval<F1,F2,Fs...> Tail;
+			enum{ form = (AFFINE==F0 && AFFINE==int(Tail::form)) ? AFFINE : GENERAL };
+			template <class... Mats>
+			static Matrix4 eval(const Matrix4& m0, const Mats&... ms){
+				Matrix4 r;
+				multiply<F0,Tail::form>(r, m0, Tail::eval(ms...));
+				return r;
+			}
+		};
 	};
 
 
+
+	/// A rigid transformation stored as a unit quaternion and a translation
+
+	/// This is a compact alternative to Matrix4 for poses. Products follow the
+	/// same convention as Matrix4; (a * b) applies b first, then a.
+	struct RigidPose{
+		typedef float value_type;
+
+		float quat[4] = {0,0,0,1};	///< Rotation as unit quaternion (x,y,z,w)
+		float pos[3] = {0,0,0};		///< Translation
+
+		RigidPose(){}
+		explicit RigidPose(const Matrix4& m){ set(m); }
+
+		RigidPose& identity(){
+			quat[0]=quat[1]=quat[2]=0; quat[3]=1;
+			pos[0]=pos[1]=pos[2]=0;
+			return *this;
+		}
+
+		/// Set from a rigid transformation matrix
+		RigidPose& set(const Matrix4& m);
+
+		/// Get as 4-by-4 matrix
+		Matrix4 toMatrix4() const {
+			const float x=quat[0], y=quat[1], z=quat[2], w=quat[3];
+			const float x2=x+x, y2=y+y, z2=z+z;
+			const float xx=x*x2, yy=y*y2, zz=z*z2;
+			const float xy=x*y2, xz=x*z2, yz=y*z2;
+			const float wx=w*x2, wy=w*y2, wz=w*z2;
+			return Matrix4{{
+				1.f-(yy+zz),	xy+wz,			xz-wy,			0.f,
+				xy-wz,			1.f-(xx+zz),	yz+wx,			0.f,
+				xz+wy,			yz-wx,			1.f-(xx+yy),	0.f,
+				pos[0],			pos[1],			pos[2],			1.f
+			}};
+		}
+
+		/// Rotate a 3-vector, dst may alias v
+		void rotate(float * dst, const float * v) const {
+			// t = 2 q x v; v' = v + w t + q x t
+			const float qx=quat[0], qy=quat[1], qz=quat[2], qw=quat[3];
+			const float tx = 2.f*(qy*v[2] - qz*v[1]);
+			const float ty = 2.f*(qz*v[0] - qx*v[2]);
+			const float tz = 2.f*(qx*v[1] - qy*v[0]);
+			const float rx = v[0] + qw*tx + (qy*tz - qz*ty);
+			const float ry = v[1] + qw*ty + (qz*tx - qx*tz);
+			const float rz = v[2] + qw*tz + (qx*ty - qy*tx);
+			dst[0]=rx; dst[1]=ry; dst[2]=rz;
+		}
+
+		/// Transform a 3-vector point, dst may alias v
+		void transformPoint(float * dst, const float * v) const {
+			rotate(dst, v);
+			for(int i=0; i<3; ++i) dst[i] += pos[i];
+		}
+
+		Vec4 rotate(const Vec4& v) const { Vec4 r(0,0,0,v.w); rotate(r.data(), v.data()); return r; }
+		Vec4 transform(const Vec4& v) const {
+			Vec4 r = rotate(v);
+			for(int i=0; i<3; ++i) r[i] += pos[i]*v.w;
+			return r;
+		}
+
+		RigidPose operator* (const RigidPose& b) const {
+			RigidPose r;
+			const float * p = quat;
+			const float * q = b.quat;
+			r.quat[0] = p[3]*q[0] + p[0]*q[3] + p[1]*q[2] - p[2]*q[1];
+			r.quat[1] = p[3]*q[1] - p[0]*q[2] + p[1]*q[3] + p[2]*q[0];
+			r.quat[2] = p[3]*q[2] + p[0]*q[1] - p[1]*q[0] + p[2]*q[3];
+			r.quat[3] = p[3]*q[3] - p[0]*q[0] - p[1]*q[1] - p[2]*q[2];
+			transformPoint(r.pos, b.pos);
+			return r;
+		}
+
+		/// Get this * b^-1 without forming the inverse of b
+		RigidPose mulInverse(const RigidPose& b) const {
+			RigidPose r;
+			const float * p = quat;
+			const float * q = b.quat;
+			r.quat[0] = p[0]*q[3] - p[3]*q[0] - p[1]*q[2] + p[2]*q[1];
+			r.quat[1] = p[1]*q[3] - p[3]*q[1] + p[0]*q[2] - p[2]*q[0];
+			r.quat[2] = p[2]*q[3] - p[3]*q[2] - p[0]*q[1] + p[1]*q[0];
+			r.quat[3] = p[3]*q[3] + p[0]*q[0] + p[1]*q[1] + p[2]*q[2];
+			r.rotate(r.pos, b.pos);
+			for(int i=0; i<3; ++i) r.pos[i] = pos[i] - r.pos[i];
+			return r;
+		}
+
+		RigidPose& invert(){
+			for(int i=0; i<3; ++i){ quat[i] = -quat[i]; pos[i] = -pos[i]; }
+			rotate(pos, pos);
+			return *this;
+		}
+
+		RigidPose inverse() const { return RigidPose(*this).invert(); }
+
+		/// Renormalize quaternion (to counter drift from repeated products)
+		RigidPose& normalize(){
+			const float n = quat[0]*quat[0] + quat[1]*quat[1] + quat[2]*quat[2] + quat[3]*quat[3];
+			const float s = n > 0.f ? 1.f/std::sqrt(n) : 0.f;
+			for(auto& v : quat) v *= s;
+			return *this;
+		}
+
+		/// Normalized linear interpolation; fast and good for small angles
+		static RigidPose nlerp(const RigidPose& a, const RigidPose& b, float t){
+			RigidPose r;
+			const float dot = a.quat[0]*b.quat[0] + a.quat[1]*b.quat[1] + a.quat[2]*b.quat[2] + a.quat[3]*b.quat[3];
+			const float tb = dot < 0.f ? -t : t; // take shortest arc
+			for(int i=0; i<4; ++i) r.quat[i] = a.quat[i]*(1.f-t) + b.quat[i]*tb;
+			for(int i=0; i<3; ++i) r.pos[i] = a.pos[i] + (b.pos[i]-a.pos[i])*t;
+			return r.normalize();
+		}
+
+		/// Spherical linear interpolation; constant angular velocity
+		static RigidPose slerp(const RigidPose& a, const RigidPose& b, float t);
+	};
+
 	struct Event{
 		EventType type;
 		DeviceType deviceType;
 		int deviceIndex;
-		float age;
+		float age;			///< Age of event, in seconds, when it was polled
+		double time;		///< Time event occurred, in seconds (see time())
 		/*union{
 			unsigned button;	///< Button number
 			struct{unsigned axis; float x,y;};	///< Axis number and coordinates
 		};*/
-		unsigned button;	///< Button number
-		float x,y;			///< Axis coordinates
+		unsigned button;	///< Button number (AXIS0+n for AXIS_CHANGED)
+		float x,y;			///< Axis coordinates (AXIS_CHANGED only)
 
 		void print() const;
 	};
@@ -283,59 +807,445 @@ public:
 	struct TrackedDevice{
 		DeviceType type = INVALID_DEVICE;
 		Matrix4 pose;		///< Virtual world pose (can have transform parent)
-		Matrix4 posePrev;
-		Matrix4 poseAbs;	///< Absolute (tracking space) pose
+		RigidPose poseRigid;	///< Virtual world pose in compact form
+		RigidPose posePrev;	///< Previous virtual world pose
+		RigidPose poseAbs;	///< Absolute (tracking space) pose
+		float vel[3] = {0,0,0};		///< Linear velocity in world space, in m/s
+		float angVel[3] = {0,0,0};	///< Angular velocity in world space, in rad/s
+		vr::ETrackingResult trackingResult = vr::TrackingResult_Uninitialized;
 		bool valid() const { return INVALID_DEVICE!=type; }
-		void updatePose(const Matrix4& v){ posePrev=pose; pose=v; poseAbs=v; }
-		void updatePose(const Matrix4& v, const Matrix4& parent){ posePrev=pose; pose=parent*v; poseAbs=v; }
+		/// Whether tracking is running normally
+		bool trackingOK() const { return vr::TrackingResult_Running_OK == trackingResult; }
+		/// Set current pose without updating previous pose
+		void setPose(const RigidPose& v, const RigidPose& parent){ poseRigid=parent*v; poseAbs=v; pose=poseRigid.toMatrix4(); }
+		void updatePose(const RigidPose& v){ posePrev=poseRigid; poseRigid=v; poseAbs=v; pose=v.toMatrix4(); }
+		void updatePose(const RigidPose& v, const RigidPose& parent){ posePrev=poseRigid; setPose(v, parent); }
+		void updatePose(const Matrix4& v){ updatePose(RigidPose(v)); }
+		void updatePose(const Matrix4& v, const Matrix4& parent){ updatePose(RigidPose(v), RigidPose(parent)); }
+		/// Get world pose extrapolated dt seconds ahead from current velocities
+		RigidPose poseExtrapolated(float dt) const {
+			RigidPose r;
+			float ax[3] = {angVel[0]*dt, angVel[1]*dt, angVel[2]*dt};
+			const float ang = std::sqrt(ax[0]*ax[0] + ax[1]*ax[1] + ax[2]*ax[2]);
+			if(ang > 1e-8f){
+				const float s = std::sin(0.5f*ang)/ang;
+				for(int i=0; i<3; ++i) r.quat[i] = ax[i]*s;
+				r.quat[3] = std::cos(0.5f*ang);
+			}
+			r = r * poseRigid; // rotate about world axes...
+			for(int i=0; i<3; ++i) r.pos[i] = poseRigid.pos[i] + vel[i]*dt; // ...but about device origin
+			return r;
+		}
 		/// Get pose differential
-		Matrix4 poseDiff() const { return pose * posePrev.inverseRigid(); }
+		RigidPose poseDiffRigid() const { return poseRigid.mulInverse(posePrev); }
+		Matrix4 poseDiff() const { return poseDiffRigid().toMatrix4(); }
+		/// Get pose interpolated between previous (t=0) and current (t=1)
+		RigidPose poseLerp(float t) const { return RigidPose::nlerp(posePrev, poseRigid, t); }
 	private:
 		friend class VRSystem;
 		int implIndex = -1;
 	};
 
 
+	/// Pose at a point in time
+	struct TimedPose{
+		double time = 0.;	///< Time, in seconds (see VRSystem::time())
+		RigidPose pose;		///< World pose
+	};
+
+
+	/// Fixed-capacity history of a device's poses in time order
+	class PoseHistory{
+	public:
+		enum{ CAPACITY = 128 };
+
+		/// Add pose (the oldest pose is overwritten when full)
+
+		/// A time earlier than the newest pose's, e.g. from jitter of
+		/// photon time estimates, is clamped to it to keep times in order.
+		void add(double time, const RigidPose& pose){
+			if(mSize && time < newest().time) time = newest().time;
+			auto& p = mPoses[(mBegin + mSize) & (CAPACITY-1)];
+			p.time = time; p.pose = pose;
+			if(mSize < CAPACITY) ++mSize;
+			else mBegin = (mBegin+1) & (CAPACITY-1);
+		}
+
+		void clear(){ mBegin = mSize = 0; }
+
+		unsigned size() const { return mSize; }
+		bool empty() const { return 0 == mSize; }
+
+		/// Get pose by age order (0 is oldest)
+		const TimedPose& operator[](unsigned i) const { return mPoses[(mBegin + i) & (CAPACITY-1)]; }
+		const TimedPose& oldest() const { return (*this)[0]; }
+		const TimedPose& newest() const { return (*this)[mSize-1]; }
+
+		/// Get pose at time, interpolated between neighboring poses
+
+		/// Times outside of the history are clamped to the oldest or newest
+		/// pose. This is a binary search taking O(log n). Returns false if the
+		/// history is empty.
+		bool poseAt(RigidPose& dst, double time, bool slerp=false) const;
+
+	private:
+		TimedPose mPoses[CAPACITY];
+		unsigned mBegin = 0, mSize = 0;
+	};
+
+
+	/// Fixed-capacity array with a vector-like interface that never allocates
+	template <class T, unsigned N>
+	class StaticVector{
+	public:
+		/// Append element; ignored if full
+		void push_back(const T& v){ if(mSize < N) mData[mSize++] = v; }
+		void pop_back(){ if(mSize) --mSize; }
+		void clear(){ mSize = 0; }
+
+		unsigned size() const { return mSize; }
+		bool empty() const { return 0 == mSize; }
+		bool full() const { return N == mSize; }
+		static constexpr unsigned capacity(){ return N; }
+
+		T& operator[](unsigned i){ return mData[i]; }
+		const T& operator[](unsigned i) const { return mData[i]; }
+		T * data(){ return mData; }
+		const T * data() const { return mData; }
+		T * begin(){ return mData; }
+		T * end(){ return mData + mSize; }
+		const T * begin() const { return mData; }
+		const T * end() const { return mData + mSize; }
+
+	private:
+		T mData[N];
+		unsigned mSize = 0;
+	};
+
+
+	/// Lock-free single-producer, single-consumer ring buffer
+
+	/// One thread may push while another thread pops. Elements are copied in
+	/// and out so T should be small and trivially copyable.
+	template <class T, unsigned N>
+	class SPSCRing{
+	public:
+		static_assert(N && !(N & (N-1)), "SPSCRing capacity must be a power of two");
+
+		/// Push element (producer only); returns false if full
+		bool push(const T& v){
+			const unsigned w = mWrite.load(std::memory_order_relaxed);
+			if(w - mRead.load(std::memory_order_acquire) == N) return false;
+			mBuf[w & (N-1)] = v;
+			mWrite.store(w+1, std::memory_order_release);
+			return true;
+		}
+
+		/// Pop oldest element (consumer only); returns false if empty
+		bool pop(T& v){
+			const unsigned r = mRead.load(std::memory_order_relaxed);
+			if(r == mWrite.load(std::memory_order_acquire)) return false;
+			v = mBuf[r & (N-1)];
+			mRead.store(r+1, std::memory_order_release);
+			return true;
+		}
+
+		/// Discard all elements (consumer only)
+		void clear(){ mRead.store(mWrite.load(std::memory_order_acquire), std::memory_order_release); }
+
+		unsigned size() const { return mWrite.load(std::memory_order_acquire) - mRead.load(std::memory_order_acquire); }
+		bool empty() const { return 0 == size(); }
+		static constexpr unsigned capacity(){ return N; }
+
+	private:
+		T mBuf[N];
+		// Keep indices on separate cache lines to avoid false sharing
+		char mPad0[64];
+		std::atomic<unsigned> mWrite{0};
+		char mPad1[64];
+		std::atomic<unsigned> mRead{0};
+	};
+
+
+	/// Pose of a device sampled at a point in time
+	struct PoseSample{
+		double time = 0.;			///< Time of sample, in seconds (see VRSystem::time())
+		RigidPose pose;				///< World pose
+		float vel[3] = {0,0,0};		///< Linear velocity in world space, in m/s
+		float angVel[3] = {0,0,0};	///< Angular velocity in world space, in rad/s
+	};
+
+
+	/// Consistent copy of pose state that can be read from any thread
+	struct PoseSnapshot{
+		Matrix4 pose[MAX_TRACKED_DEVICES];		///< World pose of each tracked device
+		DeviceType type[MAX_TRACKED_DEVICES];	///< Type of each tracked device
+		Matrix4 viewHMD;						///< HMD view (inverse of pose)
+		Matrix4 view[2];						///< View matrix of each eye
+		Matrix4 viewProj[2];					///< View-projection matrix of each eye
+		int handToDevice[2] = {-1,-1};			///< Device index of left/right controller or -1
+		RigidPose parent;						///< Pose parent (tracking to world space)
+		uint64_t frame = 0;						///< Pose update count; 0 if never updated
+
+		/// Get world pose of controller in hand or nullptr if there is none
+		const Matrix4 * controllerPose(int hand) const {
+			return handToDevice[hand] >= 0 ? &pose[handToDevice[hand]] : nullptr;
+		}
+	};
+
+
+	/// Input state of all tracked devices in structure-of-arrays layout
+
+	/// Per-device arrays are indexed by tracked device index. Per-button
+	/// arrays hold masks of devices (bit i for device i), so a query across
+	/// all controllers and trackers is a single 64-bit operation.
+	struct InputStates{
+		typedef uint64_t Bits;
+		enum{
+			NUM_BITS = sizeof(Bits)*8,
+			MAX_AXES = 5
+		};
+		static_assert(sizeof(Bits)*8 >= NO_BUTTON && sizeof(Bits)*8 >= MAX_TRACKED_DEVICES, "");
+
+		enum GesturePhase : unsigned char { IDLE, PRESSED, RELEASED, HELD };
+		struct GestureState{
+			double time = 0.;		///< Time of last press or release
+			unsigned char clicks = 0;	///< Clicks in current sequence
+			GesturePhase phase = IDLE;
+		};
+
+		Bits buttons[MAX_TRACKED_DEVICES] = {0};		///< Button bits of each device
+		Bits touches[MAX_TRACKED_DEVICES] = {0};		///< Touch bits of each device
+		Bits buttonChanges[MAX_TRACKED_DEVICES] = {0};	///< Button change bits of each device
+		Bits touchChanges[MAX_TRACKED_DEVICES] = {0};	///< Touch change bits of each device
+		Bits buttonDevices[NUM_BITS] = {0};			///< Devices with each button down
+		Bits touchDevices[NUM_BITS] = {0};				///< Devices with each button touched
+		Bits buttonChangeDevices[NUM_BITS] = {0};		///< Devices with each button changed
+		Bits touchChangeDevices[NUM_BITS] = {0};		///< Devices with each touch changed
+		Bits changedDevices = 0;						///< Devices with any button or touch change
+		float axes[MAX_AXES][MAX_TRACKED_DEVICES][2] = {{{0}}};	///< Axis coordinates
+		float axisChanges[MAX_AXES][MAX_TRACKED_DEVICES][2] = {{{0}}};	///< Axis changes (velocities)
+		unsigned char hand[MAX_TRACKED_DEVICES];		///< Hand of each controller
+		Bits gestures[NUM_GESTURES][MAX_TRACKED_DEVICES] = {{0}};	///< Button bits of gestures recognised in last update
+		Bits gestureDevices = 0;						///< Devices with any gesture in last update
+		Bits gesturePending[MAX_TRACKED_DEVICES] = {0};	///< Button bits waiting on a gesture timer
+		Bits gesturePendingDevices = 0;					///< Devices with any pending gesture timer
+		GestureState gestureStates[MAX_TRACKED_DEVICES][NO_BUTTON];
+		GestureTiming gestureTiming;
+
+		InputStates(){ for(auto& v : hand) v = LEFT; }
+
+		/// Get devices with button down
+		Bits buttonDown(unsigned b) const { return buttonDevices[b]; }
+
+		/// Get devices whose button transitioned to down
+		Bits buttonWentDown(unsigned b) const { return buttonDevices[b] & buttonChangeDevices[b]; }
+
+		/// Get devices whose button transitioned to up
+		Bits buttonWentUp(unsigned b) const { return ~buttonDevices[b] & buttonChangeDevices[b]; }
+
+		/// Get devices with button touched
+		Bits touchDown(unsigned b) const { return touchDevices[b]; }
+
+		/// Get devices whose touch transitioned to down
+		Bits touchWentDown(unsigned b) const { return touchDevices[b] & touchChangeDevices[b]; }
+
+		/// Get devices whose touch transitioned to up
+		Bits touchWentUp(unsigned b) const { return ~touchDevices[b] & touchChangeDevices[b]; }
+
+		/// Get index of lowest device in mask or -1 if mask is empty
+		static int firstDevice(Bits mask){
+			if(!mask) return -1;
+			#ifdef __GNUC__
+			return __builtin_ctzll(mask);
+			#else
+			int i=0; while(!(mask & 1)){ mask >>= 1; ++i; } return i;
+			#endif
+		}
+
+		void setButtons(unsigned dev, Bits v){ set(buttons, buttonChanges, buttonDevices, buttonChangeDevices, dev, v); }
+		void setTouches(unsigned dev, Bits v){ set(touches, touchChanges, touchDevices, touchChangeDevices, dev, v); }
+
+		void setAxis(unsigned dev, int axisNum, float x, float y){
+			float newVals[2] = {x,y};
+			for(unsigned i=0; i<2; ++i){
+				axisChanges[axisNum][dev][i] = newVals[i] - axes[axisNum][dev][i];
+				axes[axisNum][dev][i] = newVals[i];
+			}
+		}
+
+		/// Get devices that made a gesture with button in the last update
+		Bits gesture(Gesture g, unsigned b) const {
+			Bits r = 0;
+			for(Bits d = gestureDevices; d; d &= d-1){
+				const int i = firstDevice(d);
+				r |= ((gestures[g][i] >> b) & 1) << i;
+			}
+			return r;
+		}
+
+		/// Advance gesture state machines of changed buttons and pending timers
+
+		/// Call once after the button states of all devices are set. Only
+		/// buttons that changed or wait on a timer are visited. Gestures are
+		/// one-offs that last until the next update.
+		void updateGestures(double now){
+			for(Bits d = gestureDevices; d; d &= d-1){
+				const int i = firstDevice(d);
+				for(auto& g : gestures) g[i] = 0;
+			}
+			gestureDevices = 0;
+
+			const Bits gestureButtons = (Bits(1) << NO_BUTTON) - 1;
+			for(Bits d = changedDevices | gesturePendingDevices; d; d &= d-1){
+				const int dev = firstDevice(d);
+				const Bits changed = buttonChanges[dev] & gestureButtons;
+				for(Bits b = changed | gesturePending[dev]; b; b &= b-1){
+					const int i = firstDevice(b);
+					const Bits bit = Bits(1) << i;
+					stepGesture(dev, i, (changed & bit) != 0, (buttons[dev] & bit) != 0, now);
+				}
+				if(!gesturePending[dev]) gesturePendingDevices &= ~(Bits(1) << dev);
+			}
+		}
+
+		/// Clear changes since they should be one-offs
+		void clearChanges(){
+			for(auto& v : buttonChanges) v = 0;
+			for(auto& v : touchChanges) v = 0;
+			for(auto& v : buttonChangeDevices) v = 0;
+			for(auto& v : touchChangeDevices) v = 0;
+			changedDevices = 0;
+		}
+
+	private:
+		void fireGesture(unsigned dev, unsigned b, Gesture g){
+			gestures[g][dev] |= Bits(1) << b;
+			gestureDevices |= Bits(1) << dev;
+		}
+
+		void setGesturePending(unsigned dev, unsigned b, bool v){
+			const Bits bit = Bits(1) << b;
+			if(v){
+				gesturePending[dev] |= bit;
+				gesturePendingDevices |= Bits(1) << dev;
+			} else {
+				gesturePending[dev] &= ~bit;
+			}
+		}
+
+		void stepGesture(unsigned dev, unsigned b, bool changed, bool down, double now){
+			auto& s = gestureStates[dev][b];
+			const auto dt = now - s.time;
+			if(changed && down){
+				if(RELEASED == s.phase && dt > gestureTiming.clickInterval){
+					// Click interval expired in the same update; report it before the new press
+					fireGesture(dev, b, Gesture(SINGLE_CLICK + s.clicks - 1));
+				}
+				if(!(RELEASED == s.phase && dt <= gestureTiming.clickInterval)) s.clicks = 0;
+				s.phase = PRESSED;
+				s.time = now;
+				setGesturePending(dev, b, true);
+			} else if(changed){
+				if(HELD == s.phase){
+					fireGesture(dev, b, HOLD_RELEASE);
+					s.phase = IDLE;
+				} else if(PRESSED == s.phase){
+					if(++s.clicks == 3){
+						fireGesture(dev, b, TRIPLE_CLICK);
+						s.phase = IDLE;
+					} else {
+						s.phase = RELEASED;
+						s.time = now;
+						return; // wait for click interval
+					}
+				}
+				setGesturePending(dev, b, false);
+			} else if(PRESSED == s.phase && dt >= gestureTiming.longPress){
+				// Report clicks that led up to the long press first
+				if(s.clicks) fireGesture(dev, b, Gesture(SINGLE_CLICK + s.clicks - 1));
+				fireGesture(dev, b, LONG_PRESS);
+				s.phase = HELD;
+				setGesturePending(dev, b, false);
+			} else if(RELEASED == s.phase && dt > gestureTiming.clickInterval){
+				fireGesture(dev, b, Gesture(SINGLE_CLICK + s.clicks - 1));
+				s.phase = IDLE;
+				setGesturePending(dev, b, false);
+			}
+		}
+
+		// Update device bits along with the per-button device masks.
+		// Only changed bits are visited, so this is usually a few operations.
+		void set(Bits * states, Bits * changes, Bits * byBit, Bits * changesByBit, unsigned dev, Bits v){
+			const Bits devBit = Bits(1) << dev;
+			for(Bits c = changes[dev]; c; c &= c-1) changesByBit[firstDevice(c)] &= ~devBit;
+			const Bits c = states[dev] ^ v;
+			changes[dev] = c;
+			states[dev] = v;
+			for(Bits b = c; b; b &= b-1){
+				const int i = firstDevice(b);
+				byBit[i] ^= devBit;
+				changesByBit[i] |= devBit;
+			}
+			if(c) changedDevices |= devBit;
+		}
+	};
+
+
+	/// Tracked device with input (buttons, touches and axes)
+
+	/// The input state lives in the InputStates arrays of VRSystem; this is
+	/// a view of one device's slice. Copies view the same live state.
 	class Controller : public TrackedDevice {
 	public:
 
-		enum{ MAX_AXES = 5 };
+		typedef InputStates::Bits Bits;
+		enum{ MAX_AXES = InputStates::MAX_AXES };
 
 
 		/// Get button state
-		bool button(unsigned i) const { return state(mButtons,i); }
+		bool button(unsigned i) const { return state(buttons(),i); }
 
 		/// Get button change status
-		bool buttonChanged(unsigned i) const { return state(mButtonChanges,i); }
+		bool buttonChanged(unsigned i) const { return state(buttonChanges(),i); }
 
 		/// Get whether button transitioned to down
-		bool buttonWentDown(unsigned i) const { return wentDown(mButtons,mButtonChanges,i); }
+		bool buttonWentDown(unsigned i) const { return wentDown(buttons(),buttonChanges(),i); }
 
 		/// Get whether button transitioned to up
-		bool buttonWentUp(unsigned i) const { return wentUp(mButtons,mButtonChanges,i); }
+		bool buttonWentUp(unsigned i) const { return wentUp(buttons(),buttonChanges(),i); }
 
 
 		/// Get touch state
-		bool touch(unsigned i) const { return state(mTouches,i); }
+		bool touch(unsigned i) const { return state(touches(),i); }
 
 		/// Get touch change status
-		bool touchChanged(unsigned i) const { return state(mTouchChanges,i); }
+		bool touchChanged(unsigned i) const { return state(touchChanges(),i); }
 
 		/// Get whether touch transitioned to down
-		bool touchWentDown(unsigned i) const { return wentDown(mTouches,mTouchChanges,i); }
+		bool touchWentDown(unsigned i) const { return wentDown(touches(),touchChanges(),i); }
 
 		/// Get whether touch transitioned to up
-		bool touchWentUp(unsigned i) const { return wentUp(mTouches,mTouchChanges,i); }
+		bool touchWentUp(unsigned i) const { return wentUp(touches(),touchChanges(),i); }
+
+
+		/// Get all button states (bit i is button i)
+		Bits buttons() const { return in().buttons[mIndex]; }
+		Bits buttonChanges() const { return in().buttonChanges[mIndex]; }
+
+		/// Get all touch states (bit i is button i)
+		Bits touches() const { return in().touches[mIndex]; }
+		Bits touchChanges() const { return in().touchChanges[mIndex]; }
 
 
 		/// Get an axis state (position)
-		const float * axis(Button b) const { return mAxes[b - AXIS0]; }
+		const float * axis(Button b) const { return in().axes[b - AXIS0][mIndex]; }
 
 		template <class Vec2>
 		Vec2 axis(Button b) const { return Vec2(axis(b)[0], axis(b)[1]); }
 
 		/// Get an axis change state (velocity)
-		const float * axisChange(Button b) const { return mAxisChanges[b - AXIS0]; }
+		const float * axisChange(Button b) const { return in().axisChanges[b - AXIS0][mIndex]; }
 
 		template <class Vec3>
 		Vec3 axisInWorld(Button b, float w=0.) const {
@@ -363,50 +1273,36 @@ public:
 		/// Print controller state
 		void print() const;
 
-		void updateClicks(float dt){
-			if(mButtonChanges) mClickTimer = 0.;
-			if(mClickTimer < mClickTimeMax){
-				if(mButtonChanges){
-					for(int i=0; i<NO_BUTTON; ++i){
-						if(button(i)) mClickSeq.push_back(i);
-					}
-				}
-			} else { // timer up
-				mClickSeqFinished = mClickSeq;
-				mClickSeq.clear();
-			}
-			mClickTimer += dt;
-		}
+		/// Get whether a gesture was recognised on a button in the last input update
+		bool gesture(Gesture g, unsigned button) const { return state(gestures(g), button); }
 
-		const std::vector<unsigned char>& clickSeq() const { return mClickSeq; }
-		const std::vector<unsigned char>& clickSeqFin() const { return mClickSeqFinished; }
+		/// Get all buttons with a gesture recognised in the last input update (bit i is button i)
+		Bits gestures(Gesture g) const { return in().gestures[g][mIndex]; }
 
-		unsigned clicks(int button){
-			unsigned r=0;
-			for(auto b : mClickSeqFinished) r += (b==button);
-			//mClickSeqFinished.clear(); // handled in updateClicks
-			return r;
+		/// Gestures are now updated by VRSystem along with the input states
+		void updateClicks(float /*dt*/){}
+
+		/// Get number of clicks of a finished click gesture on button, or 0 if none
+		unsigned clicks(int button) const {
+			for(int g=TRIPLE_CLICK; g>=SINGLE_CLICK; --g){
+				if(gesture(Gesture(g), button)) return g - SINGLE_CLICK + 1;
+			}
+			return 0;
 		}
 
-		int hand() const { return mHand; }
+		int hand() const { return in().hand[mIndex]; }
 
 	private:
 		friend class VRSystem;
 
-		typedef uint64_t Bits;		static_assert(sizeof(Bits)*8 >= NO_BUTTON,"");
-		Bits mButtons = 0;			// Button bit states
-		Bits mTouches = 0;			// Touch bit states
-		Bits mButtonChanges = 0;	// Button change statuses
-		Bits mTouchChanges = 0;		// Touch change statuses
-		//unsigned char mClicks[sizeof(Bits)*8] = {0};
-		float mAxes[MAX_AXES][2] ={{0}};// Axis coordinates
-		float mAxisChanges[MAX_AXES][2] ={{0}};// Axis changes (velocities)
-		//Matrix4 mDownPoses[];
-
-		std::vector<unsigned char> mClickSeq, mClickSeqFinished;
-		float mClickTimer=0., mClickTimeMax=0.2;
-		unsigned char mHand = LEFT;
-		
+		InputStates * mStates = &noStates();
+		unsigned char mIndex = 0;
+
+		const InputStates& in() const { return *mStates; }
+		InputStates& in(){ return *mStates; }
+
+		// State of a controller not attached to a VRSystem
+		static InputStates& noStates(){ static InputStates s; return s; }
 
 		static bool state(Bits states, unsigned i){
 			return bool((Bits(1) << i) & states);
@@ -417,24 +1313,6 @@ public:
 		static bool wentUp(Bits states, Bits changes, unsigned i){
 			return state(~states & changes, i);
 		}
-
-		void setAxis(int axisNum, float x, float y){
-			float newVals[2] = {x,y};
-			for(unsigned i=0; i<2; ++i){
-				mAxisChanges[axisNum][i] = newVals[i] - mAxes[axisNum][i];
-				mAxes[axisNum][i] = newVals[i];
-			}
-		}
-
-		void setButtons(Bits v){
-			mButtonChanges = mButtons ^ v;
-			mButtons = v;
-		}
-
-		void setTouches(Bits v){
-			mTouchChanges = mTouches ^ v;
-			mTouches = v;
-		}
 	};
 
 
@@ -452,8 +1330,12 @@ public:
 	/// Renders user provided draw call to HMD
 
 	/// The projection matrix will be determined by the HMD while the modelview
-	/// is left unchanged.
-	void render(std::function<void (void)> userDraw);
+	/// is left unchanged. The draw call can be any callable object; it is
+	/// called by reference so rendering never copies or allocates it.
+	template <class Draw>
+	void render(Draw&& userDraw){
+		renderFrame(&callDraw<typename std::remove_reference<Draw>::type>, (void *)&userDraw);
+	}
 	
 	/// Whether render is doing the first eye pass
 	bool firstEyePass() const { return eyePass() == LEFT; }
@@ -473,6 +1355,181 @@ public:
 	/// Set brightness of drawFrameBuffer
 	VRSystem& drawBrightness(float v){ mBright = v; return *this; }
 
+	/// Set whether both eyes render into one side-by-side atlas
+
+	/// The atlas is twice the render width. Both eyes share one frame buffer
+	/// bind, clear and depth buffer, and the atlas is submitted with
+	/// half-width texture bounds. Mirror or post-process passes can use
+	/// atlasTexture() to cover both eyes at once.
+	VRSystem& eyeAtlas(bool v){ mEyeAtlas=v; return *this; }
+	bool eyeAtlas() const { return mEyeAtlas; }
+
+	/// Get texture of the eye atlas or 0 if there is none
+	unsigned atlasTexture() const { return mFBOAtlas.mResolveTex; }
+
+	/// Get viewport (x, y, w, h) of an eye in its render target
+	void eyeViewport(int eye, int * xywh) const;
+
+	/// Get texture bounds (umin, vmin, umax, vmax) of an eye in its render target
+	void eyeBounds(int eye, float * bounds) const;
+
+	/// Set fraction of render size, along each axis, to render at
+
+	/// Eye targets keep their full size. render() draws into a sub-rectangle
+	/// of them and submits matching texture bounds, so changing the scale
+	/// never reallocates. The scale is applied at the start of render().
+	VRSystem& resolutionScale(float v){ mResScale=v; return *this; }
+	float resolutionScale() const { return mResScale; }
+
+	/// Set whether the resolution scale adapts to hold the HMD frame rate
+
+	/// Whenever a new GPU timing arrives, the scale is adjusted so that the
+	/// GPU time of a frame stays within resolutionBudget() of the frame
+	/// period. Timings come from timer queries around render() and from the
+	/// client GPU time reported by the compositor; each is scaled from the
+	/// resolution its frame was rendered at, since it arrives a frame or
+	/// more late, and the lower resulting scale is taken. The scale falls
+	/// quickly when over budget or when the compositor reprojects or drops
+	/// a frame, and recovers gradually.
+	VRSystem& dynamicResolution(bool v){ mDynamicRes=v; return *this; }
+	bool dynamicResolution() const { return mDynamicRes; }
+
+	/// Set range of the dynamic resolution scale
+	VRSystem& resolutionRange(float min, float max){ mResRange[0]=min; mResRange[1]=max; return *this; }
+	const float * resolutionRange() const { return mResRange; }
+
+	/// Set fraction of the frame period the GPU time should stay within
+	VRSystem& resolutionBudget(float v){ mResBudget=v; return *this; }
+	float resolutionBudget() const { return mResBudget; }
+
+	/// Get GPU time, in milliseconds, used by the dynamic resolution controller
+	float gpuFrameTime() const { return mGpuFrameMs; }
+
+	/// Stage of render() timed on the GPU
+	enum GpuStage{
+		GPU_FRAME,		///< All of render(), from first clear through submit
+		GPU_CLEAR,		///< Frame buffer binds and clears
+		GPU_MASK,		///< Hidden area mask
+		GPU_FOVEATION,	///< Foveation mask and gap fill
+		GPU_DRAW_LEFT,	///< Draw function, left eye (both eyes in single-pass stereo)
+		GPU_DRAW_RIGHT,	///< Draw function, right eye
+		GPU_VIGNETTE,	///< Vignette
+		GPU_RESOLVE,	///< MSAA resolve and copies to eye textures
+		GPU_SUBMIT,		///< GL work done by the compositor in Submit
+		NUM_GPU_STAGES
+	};
+
+	enum{ GPU_STATS_FRAMES = 128 };
+
+	/// Rolling statistics of a GPU stage, in milliseconds per frame
+	struct GpuStageStats{
+		float mean = 0.f;
+		float p95 = 0.f;
+		float max = 0.f;
+	};
+
+	/// Rolling statistics of all GPU stages
+	struct GpuStats{
+		GpuStageStats stage[NUM_GPU_STAGES];
+		unsigned frames = 0;	///< Number of frames the statistics are over
+		const GpuStageStats& operator[](GpuStage s) const { return stage[s]; }
+	};
+
+	/// Set whether to time the stages of render() on the GPU
+
+	/// Each stage is bracketed with GL_TIMESTAMP queries. Results are read a
+	/// few frames later once available, so timing never stalls; if a
+	/// frame's queries are still pending when their slot comes around, the
+	/// new frame is not timed. Statistics are over the last
+	/// GPU_STATS_FRAMES timed frames.
+	VRSystem& gpuTimers(bool v){ mGpuTimers=v; return *this; }
+	bool gpuTimers() const { return mGpuTimers; }
+
+	/// Get rolling statistics of GPU stages
+	GpuStats gpuStats() const;
+
+	/// Clear GPU statistics
+	VRSystem& gpuStatsReset(){ mGpuStatsFrames=0; return *this; }
+
+
+	/// Per-frame metric recorded by telemetry, in milliseconds
+	enum FrameMetric{
+		FRAME_CLIENT_CPU,		///< CPU time of render() through submit
+		FRAME_CLIENT_GPU,		///< Application GPU time seen by compositor
+		FRAME_COMPOSITOR_CPU,	///< Compositor render CPU time
+		FRAME_COMPOSITOR_GPU,	///< Compositor render GPU time
+		FRAME_WAIT_POSES,		///< Time blocked in WaitGetPoses
+		FRAME_INTERVAL,			///< Time between application frames
+		NUM_FRAME_METRICS
+	};
+
+	/// Telemetry of one compositor frame
+	struct FrameRecord{
+		double time = 0.;			///< Compositor system time, in seconds
+		uint32_t index = 0;			///< Compositor frame index
+		uint32_t presents = 0;		///< Times frame was presented; >1 means reused
+		uint32_t mispresents = 0;	///< Times frame was presented on the wrong vsync
+		uint32_t dropped = 0;		///< Vsyncs the previous frame was repeated for
+		uint32_t reprojection = 0;	///< vr::VRCompositor_Reprojection* flags
+		float ms[NUM_FRAME_METRICS] = {0};
+
+		bool reprojected() const {
+			return presents > 1 || (reprojection & (vr::VRCompositor_ReprojectionReason_Cpu | vr::VRCompositor_ReprojectionReason_Gpu));
+		}
+	};
+
+	/// Frame health totals over a telemetry session
+	struct FrameHealth{
+		unsigned long frames = 0;		///< Frames recorded
+		unsigned long dropped = 0;
+		unsigned long reprojected = 0;
+		unsigned long mispresented = 0;
+		vr::Compositor_CumulativeStats compositor = {}; ///< Compositor totals for this process
+	};
+
+	/// Set whether to record compositor frame telemetry
+
+	/// Each frame, render() fetches the compositor's timing of the last
+	/// presented frame and its cumulative stats. The timing is paired with
+	/// the CPU time and WaitGetPoses block time measured for the previous
+	/// render() and stored in a ring of the most recent 'frames'. Turning
+	/// telemetry on starts a new session; the ring is allocated then so
+	/// nothing is allocated per frame.
+	VRSystem& telemetry(bool v, unsigned frames=4096);
+	bool telemetry() const { return mTelemetry; }
+
+	/// Get number of frames in telemetry ring
+	unsigned telemetryFrames() const {
+		return mFrameHealth.frames < mTelemetryRing.size() ? mFrameHealth.frames : mTelemetryRing.size();
+	}
+
+	/// Get telemetry of a frame; 0 is the most recent up to telemetryFrames()-1
+	const FrameRecord& telemetryFrame(unsigned ago) const {
+		return mTelemetryRing[(mFrameHealth.frames - 1 - ago) % mTelemetryRing.size()];
+	}
+
+	/// Get frame health totals of the telemetry session
+	const FrameHealth& frameHealth() const { return mFrameHealth; }
+
+	/// Get percentile, in [0,100], of a metric over the telemetry ring
+
+	/// Does not allocate; selects in a scratch buffer sized with the ring, so
+	/// calls must not overlap across threads.
+	float telemetryPercentile(FrameMetric m, float percent) const;
+
+	/// Get histogram of a metric over the telemetry ring
+
+	/// Bin i counts frames in [i*binMs, (i+1)*binMs); the last bin also
+	/// counts frames beyond. Returns number of frames counted.
+	unsigned telemetryHistogram(FrameMetric m, unsigned * bins, unsigned numBins, float binMs=1.f) const;
+
+	/// Write telemetry ring to file, oldest frame first
+
+	/// The CSV has one header line. The binary format is the 4 chars
+	/// "VRTL", uint32 sizeof(FrameRecord), uint32 record count, then
+	/// FrameRecords in native byte order. Returns false on I/O error.
+	bool telemetryDump(const std::string& path, bool binary=false) const;
+
 	/// Get generic tracked device
 	TrackedDevice& trackedDevice(int i){ return mTrackedDevices[i]; }
 	const TrackedDevice& trackedDevice(int i) const { return mTrackedDevices[i]; }
@@ -487,6 +1544,19 @@ public:
 	/// Get number of active controllers
 	unsigned numControllers(unsigned maxNum=0xffffffff) const;
 
+	/// Get input of any tracked device, e.g., the pogo pins of a tracker
+	const Controller& input(int device) const { return mTrackedDevices[device]; }
+
+	/// Get input states of all devices for bulk queries
+
+	/// E.g., inputStates().buttonWentDown(TRIGGER) is a mask of all devices
+	/// whose trigger was just pressed.
+	const InputStates& inputStates() const { return mInputStates; }
+
+	/// Set timing of button gestures (see Controller::gesture)
+	VRSystem& gestureTiming(const GestureTiming& v){ mInputStates.gestureTiming=v; return *this; }
+	const GestureTiming& gestureTiming() const { return mInputStates.gestureTiming; }
+
 	/// Get tracker
 
 	/// Orientation is relative to back of tracker:
@@ -504,13 +1574,120 @@ public:
 	/// \returns true while there are more events
 	bool pollEvent();
 
+	/// Get all pending events at once
+
+	/// This drains the event queue (up to max events), translating each event
+	/// and keeping only those whose category is in filter. Events are still
+	/// processed internally when filtered out. Controller and tracker input
+	/// states are updated when a call finds the queue empty, so call this
+	/// until it returns fewer than max events, as with pollEvent().
+	/// \returns the number of events written to out
+	size_t pollEvents(Event * out, size_t max, EventMask filter=ALL_EVENTS);
+
 	/// Get last polled event
 	const Event& event() const { return mEvent; }
 
+	/// Set whether render() pumps input into the input queue
+
+	/// When on, render() calls pumpInput() at the end of every frame, so a
+	/// separate thread can receive input via consumeEvent() without waiting
+	/// on the render thread. Do not also call pollEvent() or pollEvents(),
+	/// as they would take events meant for the queue.
+	VRSystem& inputPump(bool v, EventMask filter=ALL_EVENTS){ mInputPump=v; mInputPumpFilter=filter; return *this; }
+	bool inputPump() const { return mInputPump; }
+
+	/// Drain OpenVR events and controller states into the input queue
+
+	/// Events in filter are timestamped and pushed, in order, into a lock-free
+	/// single-producer/single-consumer queue. Changes of controller axes are
+	/// pushed as AXIS_CHANGED events. Only one thread may pump; this is the
+	/// render thread when inputPump() is on. Controller states (controller(),
+	/// input()) are owned by the pumping thread.
+	/// \returns the number of events pushed
+	size_t pumpInput(EventMask filter=ALL_EVENTS);
+
+	/// Get next event from the input queue
+
+	/// Only one thread may consume. It must not read controller states;
+	/// the events carry the changes.
+	/// \returns false if the queue is empty
+	bool consumeEvent(Event& dst){ return mInputQueue.pop(dst); }
+
+	/// Get number of events in input queue
+	unsigned queuedEvents() const { return mInputQueue.size(); }
+
+	/// Get number of events dropped because the input queue was full
+	unsigned long droppedEvents() const { return mDroppedEvents.load(std::memory_order_relaxed); }
+
+	enum{ INPUT_QUEUE_SIZE = 1024 };
+
 
 	/// Update all cached poses and associated matrices
 	void updatePoses();
 
+	/// Get history of world poses of a device from past calls to updatePoses()
+
+	/// Poses are timestamped with the time their photons are displayed.
+	/// This should be read on the thread that calls updatePoses().
+	const PoseHistory& poseHistory(int device) const;
+
+	/// Get world pose of a device at a time (see time()) from its pose history
+	Matrix4 poseAt(int device, double time) const;
+	bool poseAt(int device, double time, RigidPose& dst, bool slerp=false) const;
+
+	/// Get latest poses published by updatePoses()
+
+	/// This is safe to call from any thread concurrently with rendering and
+	/// never blocks the render thread. Returns false only if no consistent
+	/// snapshot could be copied, which requires the render thread to publish
+	/// several frames during a single copy.
+	bool poseSnapshot(PoseSnapshot& dst) const;
+
+	/// Start sampling device poses on a separate thread
+
+	/// Poses of all connected devices are sampled at the given rate, independent
+	/// of the display frame rate. The sampler never touches the render thread's
+	/// state, so it does not contend with WaitGetPoses. Returns false if the
+	/// sampler could not be started.
+	bool startPoseSampler(float rateHz = 1000.f);
+
+	/// Stop pose sampler thread (no other thread may be reading samples)
+	void stopPoseSampler();
+
+	bool poseSamplerRunning() const { return nullptr != mPoseSampler; }
+
+	/// Get most recent sample of a device's pose; safe to call from any thread
+	bool latestPoseSample(int device, PoseSample& dst) const;
+
+	/// Pop oldest unread sample of a device's pose
+
+	/// Use this to get every sample in order, e.g., for recording. Only one
+	/// thread may pop samples of a given device. Each device buffers up to
+	/// POSE_SAMPLE_BUFFER samples; newer samples are dropped when full.
+	bool popPoseSample(int device, PoseSample& dst);
+
+	enum{ POSE_SAMPLE_BUFFER = 256 };
+
+	/// Get monotonic time, in seconds, used to timestamp samples
+	static double time();
+
+	/// Get seconds from now until the photons of the next frame are displayed
+	float secondsToPhotons() const;
+
+	/// Get world pose of a device predicted by the runtime some seconds ahead
+
+	/// Returns the last tracked pose if the prediction is invalid and the
+	/// identity for an out-of-range device index.
+	Matrix4 predictedPose(int device, float secondsAhead) const;
+
+	/// Set whether render() uses controller and tracker poses predicted to photon time
+	///
+	/// This removes the one frame lag of hand-attached content when poses are
+	/// updated after rendering. The HMD pose and views are left as is so they
+	/// match what the compositor expects.
+	VRSystem& predictPoses(bool v){ mPredictPoses=v; return *this; }
+	bool predictPoses() const { return mPredictPoses; }
+
 	/// Set parent pose (rigid transformation) of all device poses.
 	/// This also affects the view matrices.
 	/// By default, any fixed pipeline modelview matrix will be overridden by
@@ -522,12 +1699,16 @@ public:
 			"Matrix dimensions too small");
 		const auto oldParentPose = mParentPose;
 		mParentPose.set((const typename Mat4::value_type *)&m);
+		mParentRigid.set(mParentPose);
 		mOverrideFixedModelView = true;
 		if(!valid()){
 			for(auto& dev : mTrackedDevices) dev.updatePose(mParentPose);
 			mViewHMD = mParentPose;
 			mViewHMD.invertRigid();
-			for(auto& v : mView) v = mViewHMD;
+			for(int i=0; i<2; ++i){
+				mView[i] = mViewHMD;
+				mViewProj[i] = mEyeToScreen[i] * mView[i];
+			}
 		}/* else { // update current poses
 			const auto parentPoseDiff = mParentPose * oldParentPose.inverseRigid();
 			
@@ -563,6 +1744,13 @@ public:
 	const Matrix4& projection(int eye) const;
 	const Matrix4& projection() const { return projection(eyePass()); }
 
+	/// Get combined view-projection (world to screen) transform
+
+	/// This is precomputed once per pose update and equals projection(eye) * view(eye).
+	///
+	const Matrix4& viewProjection(int eye) const { return mViewProj[eye]; }
+	const Matrix4& viewProjection() const { return viewProjection(eyePass()); }
+
 	/// Get current eye being rendered (LEFT or RIGHT)
 	int eyePass() const { return mEyePass; }
 
@@ -609,11 +1797,111 @@ public:
 	/// Whether VR is active (initialized and presenting)
 	bool active() const { return valid() && display(); }
 
+	/// Set whether built-in passes use the core profile
+
+	/// In the core profile, the hidden area mask, vignette and drawFrameBuffer
+	/// use shaders with meshes uploaded once to the GPU, and render() does
+	/// not set the fixed pipeline matrices; draw with shaders built with
+	/// stereoShaderHeader() instead. This is turned on automatically when
+	/// the GL context is a core profile context.
+	VRSystem& coreProfile(bool v){ mCoreProfile=v; return *this; }
+	bool coreProfile() const { return mCoreProfile; }
+
 	/// Whether to apply a hidden area mask pre-render to reduce raster load
 	VRSystem& hiddenAreaMask(bool v){ mHiddenAreaMask=v; return *this; }
 	bool hiddenAreaMask() const { return mHiddenAreaMask; }
 	
-	VRSystem& hiddenAreaShape(Shape v){ mMaskShape=v; return *this; }
+	VRSystem& hiddenAreaShape(Shape v){ mMaskShape=v; mMaskDirty=true; return *this; }
+
+	enum MaskMode{
+		MASK_COLOR,	///< Fill hidden area with background color only
+		MASK_DEPTH	///< Also write near plane depth so the scene is rejected there by early depth testing
+	};
+
+	/// Set how the hidden area mask is applied
+
+	/// MASK_DEPTH (the default) requires the scene to be drawn with depth
+	/// testing (GL_LESS or GL_LEQUAL).
+	VRSystem& hiddenAreaMode(MaskMode v){ mMaskMode=v; return *this; }
+	MaskMode hiddenAreaMode() const { return mMaskMode; }
+
+	/// Set whether to count the samples drawn by the draw function
+
+	/// Samples are counted with occlusion queries and read back one frame
+	/// later when available, so counting never stalls the pipeline. This is
+	/// meant for measuring fill rate, e.g., the effect of the hidden area mask.
+	VRSystem& countSamples(bool v){ mCountSamples=v; return *this; }
+	bool countSamples() const { return mCountSamples; }
+
+	/// Get number of samples drawn by the draw function in both eyes of a recent frame
+	unsigned long samplesDrawn() const { return mSamplesDrawn; }
+
+	/// Set whether to shade the lens periphery at reduced density (fixed foveation)
+
+	/// Before the draw function, the periphery is masked with near plane
+	/// depth in a pattern of 2x2 pixel quads, so masked quads are rejected by
+	/// early depth testing. Between the inner and outer ring every other quad
+	/// is shaded and beyond the outer ring one in four. Afterward, the gaps
+	/// are filled from shaded neighbors. The scene must be drawn with depth
+	/// testing. This uses GLSL 3.30 shaders in either profile.
+	VRSystem& foveation(bool v){ mFoveation=v; return *this; }
+	bool foveation() const { return mFoveation; }
+
+	/// Set radii of foveation rings in NDC units from the lens center
+
+	/// Defaults are chosen for the HMD's lenses on construction.
+	///
+	VRSystem& foveationRings(float inner, float outer){
+		mFovRings[0]=inner; mFovRings[1]=outer; return *this; }
+	const float * foveationRings() const { return mFovRings; }
+
+	/// Set whether foveation follows the gaze
+
+	/// When on, foveation rings are centered on the gaze point of each eye
+	/// using the rings set by foveationGazeRings(). During saccades, the
+	/// rings grow by the angle the eye can travel between the gaze sample and
+	/// photons, then shrink back over gazeSettle() seconds. Without a gaze
+	/// sample in the last gazeTimeout() seconds, the lens centered rings are
+	/// used.
+	VRSystem& foveationGaze(bool v){ mFovGaze=v; return *this; }
+	bool foveationGaze() const { return mFovGaze; }
+
+	/// Set radii of gaze foveation rings in NDC units from the gaze point
+	VRSystem& foveationGazeRings(float inner, float outer){
+		mFovGazeRings[0]=inner; mFovGazeRings[1]=outer; return *this; }
+	const float * foveationGazeRings() const { return mFovGazeRings; }
+
+	/// Set gaze speed above which the eye is in a saccade, in degrees/second
+	VRSystem& saccadeSpeed(float v){ mSaccadeSpeed=v; return *this; }
+	float saccadeSpeed() const { return mSaccadeSpeed; }
+
+	/// Set time for saccade margin to decay after landing, in seconds
+	VRSystem& gazeSettle(float v){ mGazeSettle=v; return *this; }
+	float gazeSettle() const { return mGazeSettle; }
+
+	/// Set age after which gaze is considered lost, in seconds
+	VRSystem& gazeTimeout(float v){ mGazeTimeout=v; return *this; }
+	float gazeTimeout() const { return mGazeTimeout; }
+
+	/// Submit a gaze sample from an eye tracker
+
+	/// The direction is in head space (-z forward, as FaceTracker::EyeData).
+	/// This is safe to call from one thread other than the render thread,
+	/// e.g., from FaceTracker::onEyeData:
+	///
+	///	tracker.onEyeData([&](){
+	///		const auto& d = tracker.eyeData();
+	///		if(d.gazeDirValid) vr.gaze(d.gazeDir);
+	///	});
+	///
+	/// Samples are consumed by render(). Returns false if the queue is full.
+	bool gaze(const float * dir, double sampleTime = VRSystem::time());
+
+	/// Get gaze point of eye in NDC as of the last render; false if gaze is lost
+	bool gazePoint(int eye, float * ndc) const;
+
+	/// Get current saccade margin, in radians
+	float gazeMargin() const { return mGazeMargin; }
 
 	/// Background color for hidden area mask and vignette
 	template <class RGB>
@@ -622,6 +1910,7 @@ public:
 		mBackground[0] = rgb[0]*255.99;
 		mBackground[1] = rgb[1]*255.99;
 		mBackground[2] = rgb[2]*255.99;
+		if(!mVigPos.empty()) updateVigMesh(); // vignette fades to background
 		return *this;
 	}
 
@@ -647,10 +1936,95 @@ public:
 	unsigned renderWidth() const { return mRenderWidth; }
 	unsigned renderHeight() const { return mRenderHeight; }
 
+	enum StereoMode{
+		MULTI_PASS_STEREO,	///< Call draw function once per eye
+		SINGLE_PASS_STEREO	///< Call draw function once for both eyes (layered rendering)
+	};
+
+	/// Set how render() draws the two eyes
+
+	/// In SINGLE_PASS_STEREO, the draw function is called once with a layered
+	/// target holding both eyes. Geometry must be drawn with
+	/// stereoInstances() times the instances using a shader built with
+	/// stereoShaderHeader(); the shader picks the eye and layer from the
+	/// instance ID. Fixed pipeline drawing only reaches the left eye. This
+	/// requires ARB_shader_viewport_layer_array or AMD_vertex_shader_layer;
+	/// without them, rendering falls back to MULTI_PASS_STEREO.
+	VRSystem& stereoMode(StereoMode v){ mStereoMode=v; return *this; }
+	StereoMode stereoMode() const { return mStereoMode; }
+
+	/// Whether the current (or last) frame is rendered in a single pass
+	bool singlePassStereo() const { return mStereoPass; }
+
+	/// Get number of instances to draw per object instance (2 in single pass, otherwise 1)
+	unsigned stereoInstances() const { return mStereoPass ? 2 : 1; }
+
+	/// Get GLSL vertex shader code for stereo rendering
+
+	/// Insert this right after the #version line (1.40 or later). It declares
+	/// the uniform block VRStereo with per-eye matrices (vrViewProj[2],
+	/// vrView[2], vrProj[2]) and the functions vrEye(), vrInstance() and
+	/// vrPosition(worldPos). vrPosition() returns the clip position and
+	/// routes the vertex to its eye's layer. The same shader works in both
+	/// stereo modes.
+	static const char * stereoShaderHeader();
+
+	/// Bind the VRStereo uniform block of a linked shader program
+
+	/// The VRStereo uniform buffer is only created and bound during render()
+	/// in single-pass stereo or once a program has been bound here, so apps
+	/// not using stereo shaders keep their own buffer at the binding point.
+	void stereoBindProgram(unsigned program) const;
+
+	/// Set uniform buffer binding point of the VRStereo block
+	VRSystem& stereoUniformBinding(unsigned v){ mStereoBinding=v; return *this; }
+	unsigned stereoUniformBinding() const { return mStereoBinding; }
+
 	/** Trigger a single haptic pulse on a controller. After this call the application may not trigger another haptic pulse on this controller and axis combination for 5ms. */
 	/// Note: At the moment, the HTC Vive only supports TOUCHPAD for the axisID.
 	void hapticPulse(int hand, int axisID, unsigned short microSec);
 
+	/// Haptic waveform: a train of pulses with a linear amplitude envelope
+
+	/// Consecutive waveforms of a hand play back to back, so an arbitrary
+	/// envelope can be built from several short segments.
+	struct HapticWave{
+		float duration = 0.1f;			///< Length of waveform, in seconds
+		float interval = 0.005f;		///< Time between pulses, in seconds (at least 5 ms)
+		float amplitude0 = 1.f;			///< Pulse strength at start, in [0,1]
+		float amplitude1 = 1.f;			///< Pulse strength at end, in [0,1]
+		float delay = 0.f;				///< Silence before the first pulse, in seconds
+		unsigned short maxMicroSec = 3999;	///< Pulse length at full strength, in microseconds
+		unsigned short axisID = TOUCHPAD;	///< Axis to pulse (see hapticPulse)
+	};
+
+	/// Start haptic scheduler thread
+
+	/// The scheduler streams queued waveforms to the controllers, keeping the
+	/// 5 ms spacing OpenVR requires between pulses, independent of the frame
+	/// rate. Returns false if the scheduler could not be started.
+	bool startHaptics();
+
+	/// Stop haptic scheduler thread (no other thread may be queuing waveforms)
+	void stopHaptics();
+
+	bool hapticsRunning() const { return nullptr != mHaptics; }
+
+	/// Queue a waveform on a controller
+
+	/// Submission is lock-free, except for waking the scheduler when it is
+	/// idle. The waveform plays on the device of controller(hand), resolved
+	/// when queued, so call this from the thread that polls events. Each
+	/// hand queues up to HAPTIC_QUEUE_SIZE waveforms.
+	/// \returns false if the scheduler is not running, there is no
+	/// controller or the queue is full
+	bool hapticWave(int hand, const HapticWave& w);
+
+	/// Stop the current waveform of a controller and discard its queue
+	void hapticStop(int hand);
+
+	enum{ HAPTIC_QUEUE_SIZE = 64 };
+
 	enum FrameType{
 		MONO,			///< Mono
 		STEREO_V,		///< Stereo top/bottom (left/right eye)
@@ -674,25 +2048,133 @@ public:
 	FrameType frameType() const { return mFrameType; }
 	const Matrix4& cameraProj(int i) const { return mCameraProjs[i]; }
 
+	/// Get manufacturer name of device
+
+	/// This copies the cached property; use propertyString() to avoid the copy.
 	std::string manufacturer(const TrackedDevice& dev) const;
+
+	/// Get model number of device
+
+	/// This copies the cached property; use propertyString() to avoid the copy.
 	std::string model(const TrackedDevice& dev) const;
 
+	/// Get device properties
+
+	/// Values are fetched from the runtime once and cached until the property
+	/// changes or the device is (de)activated, so these are cheap enough to
+	/// call every frame. If the property is not available, the default value
+	/// is returned. Returned strings are interned and stay valid for the
+	/// lifetime of the VRSystem. These should be called from the thread that
+	/// polls events.
+	float propertyFloat(int device, vr::ETrackedDeviceProperty prop, float def=0.f) const;
+	int32_t propertyInt(int device, vr::ETrackedDeviceProperty prop, int32_t def=0) const;
+	uint64_t propertyUint64(int device, vr::ETrackedDeviceProperty prop, uint64_t def=0) const;
+	bool propertyBool(int device, vr::ETrackedDeviceProperty prop, bool def=false) const;
+	const char * propertyString(int device, vr::ETrackedDeviceProperty prop, const char * def="") const;
+	const char * propertyString(const TrackedDevice& dev, vr::ETrackedDeviceProperty prop, const char * def="") const;
+
 	void print() const;
 
 	vr::IVRSystem& impl(){ return *mImpl; }
 	const vr::IVRSystem& impl() const { return *mImpl; }
 
+	/// Get number of calls VRSystem has made to the OpenVR runtime
+
+	/// Calls made by the pose sampler thread are not included.
+	unsigned long runtimeCalls() const { return mRuntimeCalls.load(std::memory_order_relaxed); }
+
+	/// Get number of runtime calls made during the last frame (between render() calls)
+	unsigned runtimeCallsPerFrame() const { return mRuntimeCallsPerFrame; }
+
+	/// Get number of heap allocations made by the process
+
+	/// This always returns 0 unless VRSystem.cpp is compiled with
+	/// VRSYSTEM_COUNT_ALLOCS defined, which replaces the global operator new.
+	static unsigned long allocations();
+
+	/// Get number of heap allocations made during the last frame (between render() calls)
+
+	/// With VRSYSTEM_COUNT_ALLOCS, a warning is printed for any frame that
+	/// allocates once rendering has warmed up. bench/frame_allocs.cpp fails
+	/// if any frame allocates.
+	unsigned allocationsPerFrame() const { return mAllocsPerFrame; }
+
+	/// Set how often absolute poses of static tracking references are refreshed, in seconds
+
+	/// In between, their world poses are recomputed from the last absolute
+	/// pose and the current pose parent every frame.
+	VRSystem& referencePoseInterval(float v){ mRefPoseInterval=v; return *this; }
+	float referencePoseInterval() const { return mRefPoseInterval; }
+
 private:
 
 	vr::IVRSystem * mImpl = nullptr;
 	int mFlags = 0;
-	TrackedDevice mTrackedDevices[MAX_TRACKED_DEVICES];
+	Controller mTrackedDevices[MAX_TRACKED_DEVICES]; // all devices can have input
 	vr::TrackedDevicePose_t mTrackedDevicePoses[MAX_TRACKED_DEVICES];
-	std::vector<unsigned> mDeviceIndices[NO_DEVICE_TYPE];
+	StaticVector<unsigned, MAX_TRACKED_DEVICES> mDeviceIndices[NO_DEVICE_TYPE];
 	int mDevIdxHMD = 0;
 
-	vr::VRControllerState_t mControllerStates[MAX_TRACKED_DEVICES];
-	Controller mControllers[MAX_TRACKED_DEVICES];
+	// Device registry; rebuilt only when devices are (de)activated or change role
+	DeviceType mDeviceClass[MAX_TRACKED_DEVICES];
+	int mDeviceRole[MAX_TRACKED_DEVICES];	// hand of controller or -1
+	float mFrameRate = 90.f;
+	float mVsyncToPhotons = 0.f;
+	vr::HiddenAreaMesh_t mHiddenAreaMesh[2];
+	bool mRegistryDirty = true;
+	bool mEyeDirty = true;
+	double mRefPoseTime = -1e9;
+	float mRefPoseInterval = 1.f;
+	void updateDeviceRegistry();
+	DeviceType deviceClass(unsigned i) const { return i < MAX_TRACKED_DEVICES ? mDeviceClass[i] : INVALID_DEVICE; }
+
+	// Cache of device properties keyed by (device, property), open addressing
+	enum PropType{ PROP_NONE, PROP_FLOAT, PROP_INT, PROP_UINT64, PROP_BOOL, PROP_STRING };
+	struct PropEntry{
+		uint32_t key = 0; // (device+1) << 16 | property; 0 is empty
+		PropType type = PROP_NONE; // PROP_NONE if needing a fetch
+		bool ok = false;
+		union{ float f; int32_t i; uint64_t u; bool b; };
+		const char * str = ""; // interned in mPropStrings
+		PropEntry(): u(0){}
+	};
+	enum{ PROP_CACHE_SIZE = 1024 };
+	mutable std::vector<PropEntry> mPropCache;
+	mutable unsigned mPropCount = 0;
+	// Distinct string values ever fetched; never erased so pointers handed out stay valid
+	mutable std::unordered_set<std::string> mPropStrings;
+	const PropEntry& property(int device, vr::ETrackedDeviceProperty prop, PropType type) const;
+	void invalidateProperty(int device, vr::ETrackedDeviceProperty prop);
+	void invalidateProperties(int device);
+
+	void translateEvent(const vr::VREvent_t& src, Event& dst);
+	bool updateInput(unsigned device);
+	void updateInputs(bool pushAxisEvents=false);
+	bool pushEvent(const Event& e);
+
+	// Input pump
+	SPSCRing<Event, INPUT_QUEUE_SIZE> mInputQueue;
+	std::atomic<unsigned long> mDroppedEvents{0};
+	unsigned long mPushedEvents = 0;
+	EventMask mInputPumpFilter = ALL_EVENTS;
+	bool mInputPump = false;
+
+	// Runtime accessors that count calls
+	mutable std::atomic<unsigned long> mRuntimeCalls{0};
+	unsigned long mRuntimeCallsFrameStart = 0;
+	unsigned mRuntimeCallsPerFrame = 0;
+	unsigned long mAllocsFrameStart = 0;
+	unsigned mAllocsPerFrame = 0;
+	unsigned long mFramesRendered = 0;
+
+	typedef void (*DrawFunc)(void *);
+	template <class Draw> static void callDraw(void * draw){ (*static_cast<Draw *>(draw))(); }
+	void renderFrame(DrawFunc draw, void * drawCtx);
+	vr::IVRSystem& ovr() const { mRuntimeCalls.fetch_add(1, std::memory_order_relaxed); return *mImpl; }
+	vr::IVRCompositor& ovrCompositor() const { mRuntimeCalls.fetch_add(1, std::memory_order_relaxed); return *vr::VRCompositor(); }
+
+	uint32_t mInputPacketNums[MAX_TRACKED_DEVICES] = {0};
+	InputStates mInputStates;
 
 	int mEyePass = LEFT;
 	float mNear = 0.1;
@@ -707,11 +2189,14 @@ private:
 	bool mWearingHMD = false;
 	bool mOverrideFixedModelView = false;
 	bool mFirstRender = true;
+	bool mPredictPoses = false;
 	Shape mMaskShape = ELLIPSE;
 
 	Matrix4 mParentPose;
+	RigidPose mParentRigid;
 	Matrix4 mViewHMD;
 	Matrix4 mView[2];
+	Matrix4 mViewProj[2];
 	Vec4 mEye[2];
 	Matrix4 mHeadToEye[2];
 	Matrix4 mEyeToHead[2];
@@ -722,6 +2207,28 @@ private:
 
 	int mHandToDevice[2] = {1,2};
 
+	// Ring of pose snapshots, each guarded by a sequence counter (odd while
+	// being written). Readers copy the latest slot and retry if its counter
+	// changed; the writer never waits.
+	enum{ NUM_POSE_SNAPSHOTS = 4 };
+	struct PoseSnapshotSlot{
+		std::atomic<unsigned> seq{0};
+		PoseSnapshot data;
+	};
+	PoseSnapshotSlot mPoseSnapshots[NUM_POSE_SNAPSHOTS];
+	std::atomic<unsigned> mPoseSnapshotLatest{0};
+	uint64_t mPoseFrame = 0;
+	void publishPoseSnapshot();
+	template <class Reader> bool readPoseSnapshot(Reader read) const;
+
+	std::vector<PoseHistory> mPoseHistory;
+
+	struct PoseSampler;
+	PoseSampler * mPoseSampler = nullptr;
+
+	struct HapticScheduler;
+	HapticScheduler * mHaptics = nullptr;
+
 	struct FBO{
 		unsigned mDepthBuf = 0;
 		unsigned mRenderTex = 0;
@@ -735,6 +2242,161 @@ private:
 
 	FBO mFBOLeft;
 	FBO mFBORight;
+	FBO mFBOAtlas;
+	bool mEyeAtlas = false;
+	bool gpuReady() const { return mEyeAtlas ? mFBOAtlas.valid() : mFBOLeft.valid(); }
+
+	// Two-layer target for single pass stereo; layers are copied to the eye FBOs
+	struct StereoFBO{
+		unsigned mColorTex = 0;
+		unsigned mDepthTex = 0;
+		unsigned mLayeredBuf = 0;	// both layers attached
+		unsigned mLayerBuf[2] = {0,0};	// one layer attached
+		bool create(int w, int h);
+		void destroy();
+		bool valid() const { return mLayeredBuf; }
+	};
+
+	StereoFBO mStereoFBO;
+	unsigned mStereoUBO = 0;
+	unsigned mStereoBinding = 12;
+	mutable bool mStereoProgramBound = false;
+	StereoMode mStereoMode = MULTI_PASS_STEREO;
+	bool mStereoPass = false;
+	bool mStereoUnsupported = false;
+	bool stereoCreate();
+	void updateStereoUniforms(int eyes, int firstEye);
+	void drawHiddenAreaMask();
+	void drawHiddenAreaMesh();
+	void drawVignette();
+	void pushFixedView();
+	void popFixedView();
+
+	// Shaders and meshes of the built-in passes in the core profile
+	struct CoreGL{
+		unsigned mMeshProg = 0;	// 2D mesh with per-vertex color
+		int mMeshMVP = -1, mMeshColor = -1;
+		unsigned mTexProg = 0;	// textured quad
+		int mTexRect = -1, mTexBounds = -1, mTexBright = -1;
+		unsigned mMaskVAO[2] = {0,0}, mMaskVBO[2] = {0,0};
+		unsigned mMaskCount[2] = {0,0};
+		unsigned mVigVAO = 0, mVigVBO[3] = {0,0,0}; // positions, colors, indices
+		unsigned mVigCount = 0;
+		unsigned mQuadVAO = 0;
+		bool create();
+		void destroy();
+		bool valid() const { return mMeshProg; }
+	};
+
+	mutable CoreGL mCore;
+	bool mCoreProfile = false;
+	bool mMaskDirty = true;
+	bool mVigDirty = true;
+
+	MaskMode mMaskMode = MASK_DEPTH;
+
+	// Occlusion queries of draw function by frame parity and eye
+	unsigned mSampleQueries[2][2] = {{0,0},{0,0}};
+	unsigned char mSampleQueriesUsed[2] = {0,0};
+	unsigned char mSampleFrame = 0;
+	unsigned long mSamplesDrawn = 0;
+	bool mCountSamples = false;
+	void beginSampleCount(int eye);
+	void endSampleCount();
+	void readSampleCounts();
+
+	// Programs and copy target of fixed foveation
+	struct FoveaGL{
+		unsigned mMaskProg = 0;	// writes depth of skipped quads
+		unsigned mFillProg = 0;	// fills skipped quads from copy
+		int mMaskViewport = -1, mMaskLens = -1;
+		int mFillViewport = -1, mFillLens = -1;
+		unsigned mVAO = 0;
+		unsigned mCopyTex = 0, mCopyBuf = 0;
+		int mCopyW = 0, mCopyH = 0;
+		bool create();
+		void destroy();
+		bool valid() const { return mMaskProg; }
+	};
+
+	FoveaGL mFovea;
+	float mFovRings[2] = {0.6f, 0.85f};
+	bool mFoveation = false;
+	bool mFoveaUnsupported = false;
+	bool foveaCreate();
+	void updateFoveation();
+	void drawFoveationMask(const int * vp);
+	void fillFoveationGaps(const int * vp);
+
+	// Per eye foveation pattern: center in NDC, inner and outer radius squared
+	float mFovPattern[2][4] = {{0,0,0,0},{0,0,0,0}};
+	float mFovGazeRings[2] = {0.25f, 0.5f};
+	bool mFovGaze = false;
+
+	struct GazeSample{
+		double time = 0.;
+		float dir[3] = {0,0,-1};
+	};
+	enum{ GAZE_QUEUE_SIZE = 64 };
+	SPSCRing<GazeSample, GAZE_QUEUE_SIZE> mGazeQueue;
+	GazeSample mGazeLast;
+	float mGazeNDC[2][2] = {{0,0},{0,0}};
+	float mGazeSpeed = 0.f;			// rad/s
+	float mGazeMargin = 0.f;		// rad
+	double mGazeMarginTime = 0.;
+	float mSaccadeSpeed = 100.f;	// deg/s
+	float mGazeSettle = 0.05f;
+	float mGazeTimeout = 0.1f;
+	bool mGazeFresh = false;
+	void updateGaze();
+
+	// Size of eye viewports this frame; 0 until first render
+	int mViewW = 0, mViewH = 0;
+	float mViewScale = 1.f;	// resolution scale of mViewW, mViewH
+	float mResScale = 1.f;
+	float mResRange[2] = {0.5f, 1.f};
+	float mResBudget = 0.85f;
+	bool mDynamicRes = false;
+	void updateResolution(bool newTiming);
+
+	uint32_t mCompositorFrame = 0;
+	vr::Compositor_FrameTiming mFrameTiming;
+	bool readFrameTiming();
+
+	std::vector<FrameRecord> mTelemetryRing;
+	mutable std::vector<float> mTelemetryScratch;	// sized to mTelemetryRing for telemetryPercentile
+	FrameHealth mFrameHealth;
+	double mRenderStart = 0.;
+	float mClientCpuMs = 0.f;
+	float mWaitPosesMs = 0.f;
+	bool mTelemetry = false;
+	void recordTelemetry();
+
+	// GPU timestamp pairs of render() stages for the last few frames
+	enum{ NUM_GPU_TIMER_FRAMES = 3, MAX_GPU_MARKS = 24 };
+	struct GpuTimerFrame{
+		unsigned queries[2*MAX_GPU_MARKS] = {0};
+		unsigned char stages[MAX_GPU_MARKS];
+		unsigned numMarks = 0;
+		unsigned lastQuery = 0;	// index of the query issued last
+		float resScale = 1.f;	// resolution scale the frame rendered at
+		bool pending = false;
+	};
+	GpuTimerFrame mGpuTimerFrames[NUM_GPU_TIMER_FRAMES];
+	unsigned mGpuTimerFrame = 0;
+	float mGpuStageMs[NUM_GPU_STAGES][GPU_STATS_FRAMES];
+	unsigned long mGpuStatsFrames = 0;
+	float mGpuFrameMs = 0.f;
+	float mGpuFrameScale = 1.f;	// resolution scale of the frame mGpuFrameMs timed
+	bool mGpuFrameFresh = false;	// mGpuFrameMs not yet used by updateResolution
+	bool mGpuTimers = false;
+	bool mGpuTiming = false;	// timing current frame
+	void beginGpuFrame();
+	void endGpuFrame();
+	int beginGpuStage(GpuStage s);
+	void endGpuStage(int mark);
+	void readGpuTimers();
+	void updateCoreMeshes();
 	unsigned mRenderWidth=0, mRenderHeight=0; // 0 == get recommended value
 
 	float mBright = 1.f;
@@ -752,6 +2414,7 @@ private:
 	void popViewport();
 
 	const Matrix4& poseDevice(int i) const;
+	void updatePredictedPoses();
 	int controllerIndex(int hand) const;
 
 	vr::TrackedCameraHandle_t mCamera = INVALID_TRACKED_CAMERA_HANDLE;
@@ -772,20 +2435,26 @@ private:
 	void drawDistortion();
 
 public:
-	void drawTexture(unsigned tex, float stretchx=1, float stretchy=1, float anchorx=0, float anchory=0) const;
+	void drawTexture(unsigned tex, float stretchx=1, float stretchy=1, float anchorx=0, float anchory=0, const float * bounds=nullptr) const;
 
 	// Get a controller pose
 	[[deprecated]] const Matrix4& poseController(int hand) const;
 };
 
 inline VRSystem::Vec4 VRSystem::Vec4::operator* (const VRSystem::Matrix4& m) const {
-	return { dot(m.col<0>()), dot(m.col<1>()), dot(m.col<2>()), dot(m.col<3>()) };
+	Vec4 r;
+	Matrix4::transformRow(r.data(), data(), m.data());
+	return r;
 }
 
 VRSystem::Matrix4 toMatrix4(const vr::HmdMatrix34_t& m);
 VRSystem::Matrix4 toMatrix4(const vr::HmdMatrix44_t& m);
+VRSystem::RigidPose toRigidPose(const vr::HmdMatrix34_t& m);
+vr::HmdMatrix34_t toHmdMatrix34(const VRSystem::RigidPose& p);
 const char * toString(vr::EVREventType v);
 const char * toString(VRSystem::EventType v);
 const char * toString(VRSystem::DeviceType v);
+const char * toString(VRSystem::GpuStage v);
+const char * toString(VRSystem::FrameMetric v);
 
 #endif // include guard
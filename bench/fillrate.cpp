@@ -0,0 +1,93 @@
+// Fill rate benchmark of the hidden area mask modes
+//
+// Draws four full-screen layers with an expensive fragment shader and
+// compares MASK_COLOR against MASK_DEPTH, reporting frame time and the
+// fragment count of an occlusion query around the scene (countSamples).
+// Needs a running OpenVR runtime (an HMD or SteamVR's null driver):
+//
+//	g++ -O2 -std=c++14 -I.. fillrate.cpp ../VRSystem.cpp -lopenvr_api -lGLEW -lEGL -lGL -pthread -o fillrate
+//
+// Pass "core" to run with a core profile context.
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include "glcontext.h"
+#include "VRSystem.h"
+
+GLuint compile(GLenum type, const char * src){
+	GLuint s = glCreateShader(type);
+	glShaderSource(s, 1, &src, NULL);
+	glCompileShader(s);
+	GLint ok = 0;
+	glGetShaderiv(s, GL_COMPILE_STATUS, &ok);
+	if(!ok){
+		char log[1024];
+		glGetShaderInfoLog(s, sizeof(log), NULL, log);
+		printf("Error compiling shader: %s\n", log);
+	}
+	return s;
+}
+
+int main(int argc, char ** argv){
+	const bool core = argc > 1 && !strcmp(argv[1], "core");
+	if(!makeGLContext(core)) return 1;
+	VRSystem vr;
+	if(!vr.active()){
+		printf("VR not available\n");
+		return 1;
+	}
+	vr.renderSize(512, 512).coreProfile(core).countSamples(true);
+
+	// Full-screen triangle at depth z, shaded with a 64 iteration loop
+	const char * vs =
+		"#version 330\n"
+		"uniform float z;\n"
+		"void main(){\n"
+		"	vec2 p = vec2((gl_VertexID&1)*4-1, (gl_VertexID&2)*2-1);\n"
+		"	gl_Position = vec4(p, z, 1.);\n"
+		"}\n";
+	const char * fs =
+		"#version 330\n"
+		"out vec4 color;\n"
+		"void main(){\n"
+		"	vec2 p = gl_FragCoord.xy*0.01;\n"
+		"	float a = 0.;\n"
+		"	for(int i=0; i<64; ++i) a += sin(p.x+float(i))*cos(p.y-float(i));\n"
+		"	color = vec4(a*0.01+0.5, 0.5, 0.25, 1.);\n"
+		"}\n";
+	GLuint prog = glCreateProgram();
+	glAttachShader(prog, compile(GL_VERTEX_SHADER, vs));
+	glAttachShader(prog, compile(GL_FRAGMENT_SHADER, fs));
+	glLinkProgram(prog);
+	const GLint zLoc = glGetUniformLocation(prog, "z");
+	GLuint vao;
+	glGenVertexArrays(1, &vao);
+
+	auto draw = [&](){
+		glUseProgram(prog);
+		glBindVertexArray(vao);
+		for(int i=0; i<4; ++i){
+			glUniform1f(zLoc, 0.9f - 0.2f*i);
+			glDrawArrays(GL_TRIANGLES, 0, 3);
+		}
+		glBindVertexArray(0);
+		glUseProgram(0);
+	};
+
+	const VRSystem::MaskMode modes[] = {VRSystem::MASK_COLOR, VRSystem::MASK_DEPTH};
+	const char * names[] = {"MASK_COLOR", "MASK_DEPTH"};
+	const int warmup = 3, frames = 30;
+	printf("%s profile, %dx%d per eye\n", core ? "core" : "compatibility", vr.renderWidth(), vr.renderHeight());
+	for(int m=0; m<2; ++m){
+		vr.hiddenAreaMode(modes[m]);
+		for(int i=0; i<warmup; ++i) vr.render(draw);
+		glFinish();
+		const auto t0 = std::chrono::steady_clock::now();
+		for(int i=0; i<frames; ++i) vr.render(draw);
+		glFinish();
+		const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count() / frames;
+		printf("%-10s %8.2f ms/frame %10lu samples/frame\n", names[m], ms, vr.samplesDrawn());
+	}
+	return 0;
+}
@@ -0,0 +1,62 @@
+// Check that the steady-state frame loop does not allocate
+//
+// Runs pollEvent(), render() and the per-frame queries for a few hundred
+// frames and fails (exit code 1) if any frame after warm-up makes a heap
+// allocation. Needs a running OpenVR runtime (an HMD or SteamVR's null
+// driver) and VRSystem.cpp built with the allocation counter:
+//
+//	g++ -O2 -std=c++14 -DVRSYSTEM_COUNT_ALLOCS -I.. frame_allocs.cpp ../VRSystem.cpp -lopenvr_api -lGLEW -lEGL -lGL -pthread -o frame_allocs
+//
+// Exits with 77 (skipped) if VR is not available.
+
+#include <cstdio>
+#include "glcontext.h"
+#include "VRSystem.h"
+
+volatile unsigned long sink;
+int * volatile probe;
+
+int main(){
+	// Make sure the counter is compiled in, else every frame would pass
+	const auto allocsBefore = VRSystem::allocations();
+	probe = new int(0);
+	delete probe;
+	if(VRSystem::allocations() == allocsBefore){
+		printf("Error: VRSystem.cpp not built with VRSYSTEM_COUNT_ALLOCS\n");
+		return 1;
+	}
+
+	if(!makeGLContext()) return 77;
+	VRSystem vr;
+	if(!vr.active()){
+		printf("VR not available; skipping\n");
+		return 77;
+	}
+	vr.renderSize(256, 256);
+
+	const int warmup = 3, frames = 300;
+	int failedFrames = 0;
+	for(int frame=0; frame<frames; ++frame){
+		const auto start = VRSystem::allocations();
+
+		while(vr.pollEvent()){ sink += vr.event().type; }
+		vr.render([&](){
+			sink += vr.controller(vr.LEFT).buttonWentDown(vr.TRIGGER);
+			sink += vr.propertyString(vr.hmd(), vr::Prop_ManufacturerName_String)[0];
+			glClear(GL_COLOR_BUFFER_BIT);
+		});
+
+		const auto allocs = VRSystem::allocations() - start;
+		if(frame >= warmup && allocs){
+			printf("Frame %d made %lu heap allocations\n", frame, allocs);
+			++failedFrames;
+		}
+	}
+
+	if(failedFrames){
+		printf("FAILED: %d of %d frames allocated\n", failedFrames, frames - warmup);
+		return 1;
+	}
+	printf("OK: no allocations in %d frames\n", frames - warmup);
+	return 0;
+}
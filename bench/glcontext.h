@@ -0,0 +1,50 @@
+// Headless OpenGL context for benchmarks
+//
+// Uses an EGL surfaceless context, so this is Linux (Mesa) only. Set
+// LIBGL_ALWAYS_SOFTWARE=1 to run on llvmpipe.
+#pragma once
+#define GLEW_NO_GLU
+#include <GL/glew.h>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <cstdio>
+
+#ifndef EGL_PLATFORM_SURFACELESS_MESA
+#define EGL_PLATFORM_SURFACELESS_MESA 0x31DD
+#endif
+
+/// Create and make current an offscreen GL context
+
+/// A compatibility profile is made by default, otherwise a 4.5 core
+/// profile. Returns false on error.
+inline bool makeGLContext(bool core=false){
+	auto getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+	EGLDisplay display = getPlatformDisplay
+		? getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL)
+		: eglGetDisplay(EGL_DEFAULT_DISPLAY);
+	EGLint major, minor;
+	if(!eglInitialize(display, &major, &minor)){
+		printf("Error: eglInitialize failed (0x%x)\n", eglGetError());
+		return false;
+	}
+	const EGLint configAttribs[] = {EGL_SURFACE_TYPE, EGL_PBUFFER_BIT, EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE};
+	EGLConfig config;
+	EGLint numConfigs = 0;
+	eglChooseConfig(display, configAttribs, &config, 1, &numConfigs);
+	eglBindAPI(EGL_OPENGL_API);
+	const EGLint compatAttribs[] = {EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_COMPATIBILITY_PROFILE_BIT, EGL_NONE};
+	const EGLint coreAttribs[] = {EGL_CONTEXT_MAJOR_VERSION, 4, EGL_CONTEXT_MINOR_VERSION, 5, EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT, EGL_NONE};
+	EGLContext context = eglCreateContext(display, numConfigs ? config : EGL_NO_CONFIG_KHR, EGL_NO_CONTEXT, core ? coreAttribs : compatAttribs);
+	if(!context || !eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context)){
+		printf("Error: unable to create GL context (0x%x)\n", eglGetError());
+		return false;
+	}
+	// GLEW may report a missing GLX display here; only GL entry points matter
+	glewExperimental = GL_TRUE;
+	glewInit();
+	if(!eglGetProcAddress("glGenFramebuffers")){
+		printf("Error: unable to load GL functions\n");
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,160 @@
+// Microbenchmark of Matrix4/Vec4 kernels
+//
+// Times the Matrix4 products and inverses against the scalar expressions
+// they replaced and checks that both agree. Build once as is and once with
+// -DVRSYSTEM_NO_SIMD (and/or -mavx2 -mfma) to compare code paths. Only the
+// header is needed:
+//
+//	g++ -O2 -std=c++14 -I.. matrix.cpp -o matrix
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include "VRSystem.h"
+
+typedef VRSystem::Matrix4 Matrix4;
+typedef VRSystem::Vec4 Vec4;
+
+// Scalar code Matrix4 used before the SIMD kernels
+namespace reference{
+
+Matrix4 multiply(const Matrix4& a, const Matrix4& n){
+	const float * m = a.m;
+	return Matrix4{{
+		m[0]*n[ 0] + m[4]*n[ 1] + m[8]*n[ 2] + m[12]*n[ 3], m[1]*n[ 0] + m[5]*n[ 1] + m[9]*n[ 2] + m[13]*n[ 3], m[2]*n[ 0] + m[6]*n[ 1] + m[10]*n[ 2] + m[14]*n[ 3], m[3]*n[ 0] + m[7]*n[ 1] + m[11]*n[ 2] + m[15]*n[ 3],
+		m[0]*n[ 4] + m[4]*n[ 5] + m[8]*n[ 6] + m[12]*n[ 7], m[1]*n[ 4] + m[5]*n[ 5] + m[9]*n[ 6] + m[13]*n[ 7], m[2]*n[ 4] + m[6]*n[ 5] + m[10]*n[ 6] + m[14]*n[ 7], m[3]*n[ 4] + m[7]*n[ 5] + m[11]*n[ 6] + m[15]*n[ 7],
+		m[0]*n[ 8] + m[4]*n[ 9] + m[8]*n[10] + m[12]*n[11], m[1]*n[ 8] + m[5]*n[ 9] + m[9]*n[10] + m[13]*n[11], m[2]*n[ 8] + m[6]*n[ 9] + m[10]*n[10] + m[14]*n[11], m[3]*n[ 8] + m[7]*n[ 9] + m[11]*n[10] + m[15]*n[11],
+		m[0]*n[12] + m[4]*n[13] + m[8]*n[14] + m[12]*n[15], m[1]*n[12] + m[5]*n[13] + m[9]*n[14] + m[13]*n[15], m[2]*n[12] + m[6]*n[13] + m[10]*n[14] + m[14]*n[15], m[3]*n[12] + m[7]*n[13] + m[11]*n[14] + m[15]*n[15]
+	}};
+}
+
+Vec4 row(const Matrix4& m, int i){ return Vec4(m[i],m[i+4],m[i+8],m[i+12]); }
+
+Vec4 multiply(const Matrix4& m, const Vec4& v){
+	return Vec4(row(m,0).dot(v), row(m,1).dot(v), row(m,2).dot(v), row(m,3).dot(v));
+}
+
+Vec4 multiply(const Vec4& v, const Matrix4& m){
+	return Vec4(v.dot(m.col(0)), v.dot(m.col(1)), v.dot(m.col(2)), v.dot(m.col(3)));
+}
+
+Matrix4& invertRigid(Matrix4& A){
+	auto& m = A.m;
+	std::swap(m[1],m[4]);
+	std::swap(m[2],m[8]);
+	std::swap(m[6],m[9]);
+	auto itx = m[ 0]*-m[12] + m[ 4]*-m[13] + m[ 8]*-m[14];
+	auto ity = m[ 1]*-m[12] + m[ 5]*-m[13] + m[ 9]*-m[14];
+	auto itz = m[ 2]*-m[12] + m[ 6]*-m[13] + m[10]*-m[14];
+	m[12]=itx;
+	m[13]=ity;
+	m[14]=itz;
+	return A;
+}
+
+Matrix4& invertOrthogonal(Matrix4& A){
+	auto& m = A.m;
+	auto is = 1./(m[0]*m[0] + m[1]*m[1] + m[2]*m[2]);
+	for(int i:{0,1,2, 4,5,6, 8,9,10}) m[i] *= is;
+	return invertRigid(A);
+}
+
+} // reference::
+
+Matrix4 rigid(float a, float b, float tx, float ty, float tz){
+	const float ca=std::cos(a), sa=std::sin(a), cb=std::cos(b), sb=std::sin(b);
+	Matrix4 A, B;
+	A.identity(); A[0]=ca; A[1]=sa; A[4]=-sa; A[5]=ca;
+	B.identity(); B[5]=cb; B[6]=sb; B[9]=-sb; B[10]=cb;
+	Matrix4 r = A*B;
+	r[12]=tx; r[13]=ty; r[14]=tz;
+	return r;
+}
+
+float maxDiff(const float * a, const float * b, int n){
+	float d = 0.f;
+	for(int i=0; i<n; ++i) d = std::max(d, std::fabs(a[i]-b[i]));
+	return d;
+}
+
+volatile float sink;
+
+template <class F>
+double nsPerOp(int N, F f){
+	auto t0 = std::chrono::steady_clock::now();
+	for(int i=0; i<N; ++i) f(i);
+	return std::chrono::duration<double,std::nano>(std::chrono::steady_clock::now()-t0).count() / N;
+}
+
+// Best of interleaved runs, so both sides see the same machine noise
+template <class F, class G>
+void compare(const char * name, int N, F ref, G cur){
+	enum{ RUNS = 20 };
+	double bestRef = 1e9, bestCur = 1e9;
+	for(int r=0; r<RUNS; ++r){
+		bestRef = std::min(bestRef, nsPerOp(N/RUNS, ref));
+		bestCur = std::min(bestCur, nsPerOp(N/RUNS, cur));
+	}
+	printf("%-20s %10.2f %10.2f\n", name, bestRef, bestCur);
+}
+
+int main(){
+	enum{ K = 64 }; // working set of matrices, like a scene of trackers
+	Matrix4 a[K], b[K], c[K];
+	Vec4 v[K];
+	for(int i=0; i<K; ++i){
+		a[i] = rigid(i*.1f, i*.2f, i, 2, 3);
+		b[i] = rigid(i*.3f, -i*.1f, 1, -i, .5f);
+		v[i] = Vec4(i, 1, 2, 1);
+	}
+	enum{ P = 1024 }; // point coordinates, as read from a vertex array
+	float p[P];
+	for(int i=0; i<P; ++i) p[i] = std::sin(i*.1f);
+
+	float err = 0.f;
+	for(int i=0; i<K; ++i){
+		auto r = reference::multiply(a[i], b[i]);
+		err = std::max(err, maxDiff((a[i]*b[i]).m, r.m, 16));
+		err = std::max(err, maxDiff((a[i]*v[i]).data(), reference::multiply(a[i], v[i]).data(), 4));
+		err = std::max(err, maxDiff((v[i]*a[i]).data(), reference::multiply(v[i], a[i]).data(), 4));
+		r = a[i];
+		err = std::max(err, maxDiff(a[i].inverseRigid().m, reference::invertRigid(r).m, 16));
+		Matrix4 s = a[i];
+		for(int j=0; j<12; ++j) s[j] *= 2.5f;
+		r = s;
+		err = std::max(err, maxDiff(s.invertOrthogonal().m, reference::invertOrthogonal(r).m, 16));
+	}
+	printf("max difference from reference: %g\n", err);
+
+	const int N = 20000000;
+	printf("%-20s %10s %10s\n", "ns/op", "reference", "Matrix4");
+	#define BENCH(name, ref, cur)\
+		compare(name, N, [&](int i){ ref; }, [&](int i){ cur; });
+	BENCH("Matrix4 * Matrix4",
+		c[i&63] = reference::multiply(a[i&63], b[(i+1)&63]),
+		c[i&63] = a[i&63] * b[(i+1)&63])
+	BENCH("Matrix4 * Vec4",
+		v[i&63] = reference::multiply(a[i&63], v[(i+7)&63]),
+		v[i&63] = a[i&63] * v[(i+7)&63])
+	BENCH("Matrix4 * (x,y,z,1)",
+		v[i&63] = reference::multiply(a[i&63], Vec4(p[i&(P-1)], p[(i+1)&(P-1)], p[(i+2)&(P-1)], 1.f)),
+		v[i&63] = a[i&63] * Vec4(p[i&(P-1)], p[(i+1)&(P-1)], p[(i+2)&(P-1)], 1.f))
+	BENCH("Vec4 * Matrix4",
+		v[i&63] = reference::multiply(v[(i+7)&63], a[i&63]),
+		v[i&63] = v[(i+7)&63] * a[i&63])
+	BENCH("invertRigid",
+		c[i&63] = a[i&63]; reference::invertRigid(c[i&63]),
+		c[i&63] = a[i&63]; c[i&63].invertRigid())
+	BENCH("invertOrthogonal",
+		c[i&63] = a[i&63]; reference::invertOrthogonal(c[i&63]),
+		c[i&63] = a[i&63]; c[i&63].invertOrthogonal())
+	#undef BENCH
+
+	// Batch functions, per matrix
+	printf("%-20s %10s %10.2f\n", "batch a * b[i]", "", nsPerOp(N/K, [&](int i){ Matrix4::multiply(c, a[i&63], b, K); }) / K);
+	printf("%-20s %10s %10.2f\n", "batch a[i] * b[i]", "", nsPerOp(N/K, [&](int){ Matrix4::multiply(c, a, b, K); }) / K);
+	printf("%-20s %10s %10.2f\n", "batch inverseRigid", "", nsPerOp(N/K, [&](int){ Matrix4::inverseRigid(c, a, K); }) / K);
+
+	sink = c[5][3] + v[3][1];
+	return err < 1e-4f ? 0 : 1;
+}
@@ -0,0 +1,78 @@
+// Check that pollEvents() updates input once per drained queue
+//
+// Button changes (buttonWentDown/Up) and gesture one-shots last until the
+// next input update, so draining a burst of events in several pollEvents()
+// calls must update input only once, after the call that empties the queue.
+// Counts runtime calls to find input updates and fails (exit code 1) if a
+// call that stops at max events, or a drain loop, updates input more often.
+// Needs a running OpenVR runtime with at least one controller:
+//
+//	g++ -O2 -std=c++14 -I.. poll_events.cpp ../VRSystem.cpp -lopenvr_api -lGLEW -lGL -pthread -o poll_events
+//
+// Exits with 77 (skipped) if VR or a controller is not available.
+
+#include <chrono>
+#include <cstdio>
+#include <thread>
+#include "VRSystem.h"
+
+int main(){
+	VRSystem vr;
+	if(!vr.active()){
+		printf("VR not available; skipping\n");
+		return 77;
+	}
+	vr.updatePoses();
+	VRSystem::Event buf[16];
+	while(vr.pollEvents(buf, 16) == 16){}
+	if(!vr.numControllers()){
+		printf("No controllers; skipping\n");
+		return 77;
+	}
+
+	int failures = 0;
+
+	// Runtime calls of one input update: a call on an empty queue makes one
+	// PollNextEvent call plus the update
+	auto calls = vr.runtimeCalls();
+	while(vr.pollEvents(buf, 16)) calls = vr.runtimeCalls();
+	const auto updateCalls = vr.runtimeCalls() - calls - 1;
+	printf("Input update makes %lu runtime calls\n", updateCalls);
+
+	// A call that returns max events has not drained the queue
+	calls = vr.runtimeCalls();
+	for(int i=0; i<10; ++i) vr.pollEvents(buf, 0);
+	if(vr.runtimeCalls() != calls){
+		printf("pollEvents(buf, 0) made %lu runtime calls, expected 0\n", vr.runtimeCalls() - calls);
+		++failures;
+	}
+
+	// Drain whatever the runtime queues in between, one event per call
+	size_t largestBurst = 0;
+	for(int frame=0; frame<200; ++frame){
+		std::this_thread::sleep_for(std::chrono::milliseconds(11));
+		calls = vr.runtimeCalls();
+		size_t num = 0;
+		bool deviceEvents = false;
+		while(vr.pollEvents(buf, 1)){
+			++num;
+			deviceEvents |= bool(VRSystem::eventCategory(buf[0].type) & VRSystem::DEVICE_EVENTS);
+		}
+		// Device changes rebuild the registry, which makes extra calls
+		if(deviceEvents) continue;
+		largestBurst = std::max(largestBurst, num);
+		const auto expected = num + 1 + updateCalls;
+		if(vr.runtimeCalls() - calls != expected){
+			printf("Draining %zu events made %lu runtime calls, expected %lu\n", num, vr.runtimeCalls() - calls, expected);
+			++failures;
+		}
+	}
+	printf("Largest burst drained: %zu events\n", largestBurst);
+
+	if(failures){
+		printf("FAILED: %d errors\n", failures);
+		return 1;
+	}
+	printf("OK\n");
+	return 0;
+}
@@ -0,0 +1,58 @@
+// Check of PoseHistory with out-of-order timestamps
+//
+// Photon time estimates jitter, so a pose can be stamped earlier than the
+// one before it. Adds such a stamp and fails (exit code 1) if the history
+// is left out of time order or poseAt() stops moving forward with time:
+//
+//	g++ -O2 -std=c++14 -I.. pose_history.cpp ../VRSystem.cpp -lopenvr_api -lGLEW -lGL -pthread -o pose_history
+
+#include <cstdio>
+#include "VRSystem.h"
+
+typedef VRSystem::PoseHistory PoseHistory;
+typedef VRSystem::RigidPose RigidPose;
+
+RigidPose poseX(float x){
+	RigidPose p;
+	p.pos[0] = x;
+	return p;
+}
+
+int main(){
+	// Device moves along x at 1 m/s; the pose at 0.5 s is stamped 0.35 s
+	PoseHistory h;
+	for(int i=0; i<=4; ++i) h.add(i*0.1, poseX(i*0.1f));
+	h.add(0.35, poseX(0.5f));
+	for(int i=6; i<=20; ++i) h.add(i*0.1, poseX(i*0.1f));
+
+	int failures = 0;
+	for(unsigned i=1; i<h.size(); ++i){
+		if(h[i].time < h[i-1].time){
+			printf("History out of order at %u: %g after %g\n", i, h[i].time, h[i-1].time);
+			++failures;
+		}
+	}
+
+	float prevX = -1.f;
+	for(int i=0; i<=200; ++i){
+		const double t = i*0.01;
+		RigidPose p;
+		if(!h.poseAt(p, t)){
+			printf("poseAt(%g) failed\n", t);
+			++failures;
+			continue;
+		}
+		if(p.pos[0] < prevX - 1e-6f){
+			printf("poseAt(%g) went back to x = %g from %g\n", t, p.pos[0], prevX);
+			++failures;
+		}
+		prevX = p.pos[0];
+	}
+
+	if(failures){
+		printf("FAILED: %d errors\n", failures);
+		return 1;
+	}
+	printf("OK\n");
+	return 0;
+}
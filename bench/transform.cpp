@@ -0,0 +1,78 @@
+// Throughput benchmark of Matrix4::transformPoints/transformDirs
+//
+// Checks the batch transforms against Matrix4 * Vec4, including strided,
+// in-place and pooled runs, then measures throughput at 10K, 1M and 10M
+// points against a per-vector loop:
+//
+//	g++ -O2 -std=c++14 -I.. transform.cpp ../VRSystem.cpp -lopenvr_api -lGLEW -lGL -pthread -o transform
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <vector>
+#include "VRSystem.h"
+
+typedef VRSystem::Matrix4 Matrix4;
+typedef VRSystem::Vec4 Vec4;
+
+// Check dst against m * (src,w), with xyz triplets at the given strides
+float maxError(const Matrix4& m, const std::vector<float>& dst, unsigned dstStride, const std::vector<float>& src, unsigned srcStride, size_t count, float w){
+	float err = 0.f;
+	for(size_t i=0; i<count; ++i){
+		const auto * s = &src[i*srcStride];
+		const auto r = m * Vec4(s[0], s[1], s[2], w);
+		for(int k=0; k<3; ++k) err = std::max(err, std::fabs(r[k] - dst[i*dstStride+k]));
+	}
+	return err;
+}
+
+template <class F>
+double seconds(int reps, F f){
+	auto t0 = std::chrono::steady_clock::now();
+	for(int r=0; r<reps; ++r) f();
+	return std::chrono::duration<double>(std::chrono::steady_clock::now()-t0).count() / reps;
+}
+
+int main(){
+	Matrix4 m;
+	m.identity();
+	const float c = std::cos(.3f), s = std::sin(.3f);
+	m[0]=c; m[1]=s; m[4]=-s; m[5]=c;
+	m[12]=1; m[13]=2; m[14]=3;
+
+	// Small arrays run on the caller, large ones on the worker pool
+	float err = 0.f;
+	for(size_t n : {size_t(7), size_t(100000)}){
+		std::vector<float> src(n*5), dst(n*4, -7.f);
+		for(size_t i=0; i<src.size(); ++i) src[i] = float(i%97)*.1f;
+
+		m.transformPoints(dst.data(), src.data(), n, 4, 5);
+		err = std::max(err, maxError(m, dst, 4, src, 5, n, 1.f));
+		for(size_t i=0; i<n; ++i) if(dst[i*4+3] != -7.f) err = INFINITY; // padding untouched
+
+		m.transformDirs(dst.data(), src.data(), n, 4, 5);
+		err = std::max(err, maxError(m, dst, 4, src, 5, n, 0.f));
+
+		std::vector<float> orig(src.begin(), src.begin() + n*3), pts = orig;
+		m.transformPoints(pts.data(), n);
+		err = std::max(err, maxError(m, pts, 3, orig, 3, n, 1.f));
+	}
+	printf("max error vs Matrix4 * Vec4: %g\n", err);
+
+	printf("%10s %18s %18s %18s\n", "points", "transformPoints", "transformDirs", "Matrix4 * Vec4");
+	for(size_t n : {size_t(10000), size_t(1000000), size_t(10000000)}){
+		std::vector<float> src(n*3, 1.f), dst(n*3);
+		const int reps = n <= 10000 ? 2000 : n <= 1000000 ? 50 : 5;
+		const double tp = seconds(reps, [&]{ m.transformPoints(dst.data(), src.data(), n); });
+		const double td = seconds(reps, [&]{ m.transformDirs(dst.data(), src.data(), n); });
+		const double tv = seconds(reps, [&]{
+			for(size_t i=0; i<n; ++i){
+				const auto v = m * Vec4(src[i*3], src[i*3+1], src[i*3+2], 1.f);
+				dst[i*3] = v.x; dst[i*3+1] = v.y; dst[i*3+2] = v.z;
+			}
+		});
+		printf("%10zu %12.1f Mpt/s %12.1f Mpt/s %12.1f Mpt/s\n", n, n/tp*1e-6, n/td*1e-6, n/tv*1e-6);
+	}
+
+	return err < 1e-4f ? 0 : 1;
+}